@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include "exe2icns.h"
+#include "arena.h"
+
+enum {
+	kArenaAlign = 16,	// enough for the SSE/AVX loads, and the size header takes one unit
+};
+
+// one fixed block handed out front to back; nothing is given back until Exe2ICNSArenaReset
+// requests that don't fit any more go to malloc, so an arena never runs out
+struct Exe2ICNSArena_ {
+	char *base;
+	size_t size;
+	size_t used;	// bumped atomically, so the icon sizes of one file can be decoded on several threads
+	size_t peak;	// largest used seen by a reset; can be over size if requests went to malloc
+};
+
+void * MemAlloc(const Exe2ICNSAllocator *allocator, size_t size)
+{
+	if (allocator)
+		return allocator->alloc(allocator->ctx, size);
+	return malloc(size);
+}
+
+void * MemResize(const Exe2ICNSAllocator *allocator, void *p, size_t size)
+{
+	if (allocator)
+		return allocator->resize(allocator->ctx, p, size);
+	return realloc(p, size);
+}
+
+void MemFree(const Exe2ICNSAllocator *allocator, void *p)
+{
+	if (p == NULL)
+		return;
+	if (allocator)
+		allocator->free(allocator->ctx, p);
+	else
+		free(p);
+}
+
+void LogMessage(const Exe2ICNSContext *ctx, int level, const char *format, ...)
+{
+	char message[512];
+	va_list ap;
+	if (ctx == NULL || ctx->log == NULL)
+		return;
+	va_start(ap, format);
+	vsnprintf(message, sizeof(message), format, ap);
+	va_end(ap);
+	ctx->log(ctx->logctx, level, message);
+}
+
+static int InArena(const Exe2ICNSArena *arena, const void *p)
+{
+	const char *q = p;
+	return q >= arena->base && q < arena->base + arena->size;
+}
+
+static void * ArenaAlloc(void *ctx, size_t size)
+{
+	Exe2ICNSArena *arena = ctx;
+	size_t n = (size + kArenaAlign - 1) / kArenaAlign * kArenaAlign + kArenaAlign;
+	size_t off = __atomic_fetch_add(&arena->used, n, __ATOMIC_RELAXED);
+	char *p;
+	if (off + n > arena->size)
+		return malloc(size);
+	p = arena->base + off;
+	*(size_t *)p = size;
+	return p + kArenaAlign;
+}
+
+static void ArenaFree(void *ctx, void *p)
+{
+	if (! InArena(ctx, p))
+		free(p);
+}
+
+static void * ArenaResize(void *ctx, void *p, size_t size)
+{
+	Exe2ICNSArena *arena = ctx;
+	size_t oldsize;
+	void *q;
+	if (p == NULL)
+		return ArenaAlloc(arena, size);
+	if (! InArena(arena, p))
+		return realloc(p, size);
+	oldsize = *(size_t *)((char *)p - kArenaAlign);
+	if (size <= oldsize)
+		return p;
+	q = ArenaAlloc(arena, size);
+	if (q)
+		memcpy(q, p, oldsize);
+	return q;
+}
+
+Exe2ICNSArena * Exe2ICNSArenaCreate(size_t size)
+{
+	Exe2ICNSArena *arena = malloc(sizeof(Exe2ICNSArena));
+	if (arena == NULL)
+		return NULL;
+	arena->base = malloc(size);
+	if (arena->base == NULL) {
+		free(arena);
+		return NULL;
+	}
+	arena->size = size;
+	arena->used = 0;
+	arena->peak = 0;
+	return arena;
+}
+
+void Exe2ICNSArenaDestroy(Exe2ICNSArena *arena)
+{
+	if (arena) {
+		free(arena->base);
+		free(arena);
+	}
+}
+
+void Exe2ICNSArenaReset(Exe2ICNSArena *arena)
+{
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+	arena->used = 0;
+}
+
+void Exe2ICNSArenaGetAllocator(Exe2ICNSArena *arena, Exe2ICNSAllocator *allocator)
+{
+	allocator->alloc = ArenaAlloc;
+	allocator->resize = ArenaResize;
+	allocator->free = ArenaFree;
+	allocator->ctx = arena;
+}
+
+size_t Exe2ICNSArenaPeakUsage(const Exe2ICNSArena *arena)
+{
+	return arena->used > arena->peak ? arena->used : arena->peak;
+}
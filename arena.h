@@ -0,0 +1,15 @@
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <stddef.h>
+#include "exe2icns.h"
+
+// allocator may be NULL for plain malloc/realloc/free
+void * MemAlloc(const Exe2ICNSAllocator *allocator, size_t size);
+void * MemResize(const Exe2ICNSAllocator *allocator, void *p, size_t size);
+void MemFree(const Exe2ICNSAllocator *allocator, void *p);
+
+// format a message for the log callback of ctx; nothing happens if ctx or its log is NULL
+void LogMessage(const Exe2ICNSContext *ctx, int level, const char *format, ...);
+
+#endif
@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dib.h"
+
+// the row kernels use SSSE3 byte shuffles when the compiler is allowed to (-mssse3, -mavx2), SSE2 otherwise
+// the 8-bit palette lookup gathers 8 pixels at a time with AVX2
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define DIB_USE_SSSE3 1
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DIB_USE_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DIB_USE_AVX2 1
+#endif
+
+// the address can be unaligned
+static uint16_t Get16(const void *mem, long off)
+{
+	const uint8_t *p = mem;
+	p += off;
+	return p[0] + 256 * p[1];
+}
+static uint32_t Get32(const void *mem, long off)
+{
+	const uint8_t *p = mem;
+	p += off;
+	return p[0] + 256 * p[1] + 65536 * p[2] + 16777216U * p[3];
+}
+
+int DIBGetInfo(const uint8_t *icon, long iconsize, DIBInfo *info)
+{
+	long colours, bits, andbits;
+	memset(info, 0, sizeof(DIBInfo));
+	if (iconsize < 40)
+		return kDIBTruncated;
+	info->infosize = Get32(icon, 0);
+	info->width = (int32_t)Get32(icon, 4);
+	info->height = (int32_t)Get32(icon, 8) / 2;	// icon dib height must be divided by 2
+	info->bpp = Get16(icon, 14);
+	if (info->infosize < 40 || info->infosize > iconsize)
+		return kDIBTruncated;
+	if (Get32(icon, 16) != 0)	// BI_RGB
+		return kDIBUnsupported;
+	if (info->bpp != 4 && info->bpp != 8 && info->bpp != 24 && info->bpp != 32)
+		return kDIBUnsupported;
+	if (info->width <= 0 || info->height <= 0 || info->width > 1024 || info->height > 1024)
+		return kDIBUnsupported;
+	if (info->bpp <= 8) {
+		info->ncolours = Get32(icon, 32);
+		if (info->ncolours == 0 || info->ncolours > (1 << info->bpp))
+			info->ncolours = 1 << info->bpp;
+	}
+	// rows are aligned to 32-bit boundary
+	info->xorrow = (info->width * info->bpp + 31) / 32 * 4;
+	info->androw = (info->width + 31) / 32 * 4;
+	colours = info->infosize + 4 * info->ncolours;
+	bits = colours + info->xorrow * info->height;
+	andbits = bits + info->androw * info->height;
+	if (bits > iconsize)
+		return kDIBTruncated;
+	info->hasmask = andbits <= iconsize;
+	if (info->bpp == 32) {
+		// an old-style 32-bit icon leaves the alpha channel empty and has only the AND mask
+		const uint8_t *p = icon + colours;
+		long l, npixels = (long)info->width * info->height;
+		for (l = 0; l < npixels && info->alphamask == 0; l++)
+			info->alphamask = p[4*l + 3] != 0;
+	}
+	return 0;
+}
+
+// row[] points into the r, g, b and a planes, at the row being written
+
+// BGRA -> r, g, b and a
+static void ConvertRow32(const uint8_t *src, int width, uint8_t *const *row)
+{
+	uint8_t *r = row[kImageR], *g = row[kImageG], *b = row[kImageB], *a = row[kImageA];
+	int j = 0;
+#if DIB_USE_SSSE3
+	// each 4 pixels become B0-3 G0-3 R0-3 A0-3, and then 4 x 4 dwords are transposed
+	const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	for (; j + 16 <= width; j += 16) {
+		const __m128i *p = (const __m128i *)(src + 4 * j);
+		__m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128(p + 0), group);
+		__m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), group);
+		__m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), group);
+		__m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), group);
+		__m128i bg01 = _mm_unpacklo_epi32(s0, s1), ra01 = _mm_unpackhi_epi32(s0, s1);
+		__m128i bg23 = _mm_unpacklo_epi32(s2, s3), ra23 = _mm_unpackhi_epi32(s2, s3);
+		_mm_storeu_si128((__m128i *)(b + j), _mm_unpacklo_epi64(bg01, bg23));
+		_mm_storeu_si128((__m128i *)(g + j), _mm_unpackhi_epi64(bg01, bg23));
+		_mm_storeu_si128((__m128i *)(r + j), _mm_unpacklo_epi64(ra01, ra23));
+		_mm_storeu_si128((__m128i *)(a + j), _mm_unpackhi_epi64(ra01, ra23));
+	}
+#elif DIB_USE_SSE2
+	const __m128i lowbyte = _mm_set1_epi32(0xFF);
+	uint8_t *planes[4] = { b, g, r, a };	// in dib byte order
+	for (; j + 16 <= width; j += 16) {
+		const __m128i *p = (const __m128i *)(src + 4 * j);
+		__m128i v0 = _mm_loadu_si128(p + 0);
+		__m128i v1 = _mm_loadu_si128(p + 1);
+		__m128i v2 = _mm_loadu_si128(p + 2);
+		__m128i v3 = _mm_loadu_si128(p + 3);
+		int c;
+		for (c = 0; c < 4; c++) {
+			__m128i a0 = _mm_and_si128(_mm_srli_epi32(v0, 8 * c), lowbyte);
+			__m128i a1 = _mm_and_si128(_mm_srli_epi32(v1, 8 * c), lowbyte);
+			__m128i a2 = _mm_and_si128(_mm_srli_epi32(v2, 8 * c), lowbyte);
+			__m128i a3 = _mm_and_si128(_mm_srli_epi32(v3, 8 * c), lowbyte);
+			_mm_storeu_si128((__m128i *)(planes[c] + j), _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+		}
+	}
+#endif
+	for (; j < width; j++) {
+		r[j] = src[4*j + 2];
+		g[j] = src[4*j + 1];
+		b[j] = src[4*j + 0];
+		a[j] = src[4*j + 3];
+	}
+}
+
+// BGR -> r, g and b
+static void ConvertRow24(const uint8_t *src, int width, uint8_t *const *row)
+{
+	uint8_t *r = row[kImageR], *g = row[kImageG], *b = row[kImageB];
+	int j = 0;
+#if DIB_USE_SSSE3
+	// 16 pixels are 3 vectors; component c of pixel k is byte 3k+c, picked from whichever vector has it
+	static const int8_t pick[3][3][16] = {
+		{
+			{ 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 }
+		},
+		{
+			{ 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 }
+		},
+		{
+			{ 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 }
+		}
+	};
+	uint8_t *planes[3] = { b, g, r };	// in dib byte order
+	for (; j + 16 <= width; j += 16) {
+		const __m128i *p = (const __m128i *)(src + 3 * j);
+		__m128i v[3];
+		int c, s;
+		for (s = 0; s < 3; s++)
+			v[s] = _mm_loadu_si128(p + s);
+		for (c = 0; c < 3; c++) {
+			__m128i bytes = _mm_setzero_si128();
+			for (s = 0; s < 3; s++)
+				bytes = _mm_or_si128(bytes, _mm_shuffle_epi8(v[s], _mm_loadu_si128((const __m128i *)pick[c][s])));
+			_mm_storeu_si128((__m128i *)(planes[c] + j), bytes);
+		}
+	}
+#endif
+	for (; j < width; j++) {
+		r[j] = src[3*j + 2];
+		g[j] = src[3*j + 1];
+		b[j] = src[3*j + 0];
+	}
+}
+
+// palette holds the colours as r, g, b, 0 bytes
+static void ConvertRow8(const uint8_t *src, int width, const uint32_t *palette, uint8_t *const *row)
+{
+	uint8_t *r = row[kImageR], *g = row[kImageG], *b = row[kImageB];
+	int j = 0;
+#if DIB_USE_AVX2
+	uint8_t *planes[3] = { r, g, b };
+	__m256i pick[3];
+	const __m256i lanes = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);	// the first dword of each lane
+	int c;
+	for (c = 0; c < 3; c++)
+		pick[c] = _mm256_setr_epi8(c, c + 4, c + 8, c + 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			c, c + 4, c + 8, c + 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	for (; j + 8 <= width; j += 8) {
+		__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + j)));
+		__m256i colours = _mm256_i32gather_epi32((const int *)palette, idx, 4);
+		for (c = 0; c < 3; c++) {
+			__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(colours, pick[c]), lanes);
+			_mm_storel_epi64((__m128i *)(planes[c] + j), _mm256_castsi256_si128(bytes));
+		}
+	}
+#endif
+	for (; j < width; j++) {
+		const uint8_t *colour = (const uint8_t *)&palette[src[j]];
+		r[j] = colour[0];
+		g[j] = colour[1];
+		b[j] = colour[2];
+	}
+}
+
+// the high nibble is the left pixel
+static void ConvertRow4(const uint8_t *src, int width, const uint32_t *palette, uint8_t *const *row)
+{
+	uint8_t *r = row[kImageR], *g = row[kImageG], *b = row[kImageB];
+	int j;
+	for (j = 0; j < width; j++) {
+		const uint8_t *colour = (const uint8_t *)&palette[j % 2 ? src[j / 2] & 15 : src[j / 2] >> 4];
+		r[j] = colour[0];
+		g[j] = colour[1];
+		b[j] = colour[2];
+	}
+}
+
+// AND mask bits -> 0 (bit set, transparent) or 255
+static void ExpandMaskRow(const uint8_t *src, int width, uint8_t *mask)
+{
+	int j = 0;
+#if DIB_USE_SSE2
+	const __m128i bits = _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+	for (; j + 16 <= width; j += 16) {
+		// each of the 2 bytes spread over 8 bytes
+		__m128i v = _mm_set_epi64x((long long)(src[j / 8 + 1] * 0x0101010101010101ULL), (long long)(src[j / 8] * 0x0101010101010101ULL));
+		__m128i set = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+		_mm_storeu_si128((__m128i *)(mask + j), _mm_andnot_si128(set, _mm_set1_epi8(-1)));
+	}
+#endif
+	for (; j < width; j++)
+		mask[j] = (src[j / 8] >> (7 - j % 8)) & 1 ? 0 : 255;
+}
+
+void DecodeDIB(const uint8_t *icon, const DIBInfo *info, int first, Image *rows)
+{
+	int width = info->width;
+	int height = info->height;
+	const uint8_t *palette = icon + info->infosize;
+	const uint8_t *bits = palette + 4 * info->ncolours;
+	const uint8_t *andbits = bits + info->xorrow * info->height;
+	uint32_t colours[256];
+	int i, c;
+	
+	if (info->ncolours > 0) {
+		memset(colours, 0, sizeof(colours));
+		for (i = 0; i < info->ncolours; i++) {
+			uint8_t *colour = (uint8_t *)&colours[i];
+			colour[0] = palette[4*i + 2];
+			colour[1] = palette[4*i + 1];
+			colour[2] = palette[4*i + 0];
+		}
+	}
+	// DIB rows go from bottom to top
+	for (i = 0; i < rows->height; i++) {
+		int y = height - (first + i) - 1;
+		const uint8_t *src = bits + y * info->xorrow;
+		uint8_t *row[kImagePlanes];
+		for (c = 0; c < kImagePlanes; c++)
+			row[c] = rows->planes[c] + i * width;
+		switch (info->bpp) {
+		case 32:
+			ConvertRow32(src, width, row);
+			break;
+		case 24:
+			ConvertRow24(src, width, row);
+			break;
+		case 8:
+			ConvertRow8(src, width, colours, row);
+			break;
+		case 4:
+			ConvertRow4(src, width, colours, row);
+			break;
+		}
+		if (info->alphamask)
+			;
+		else if (info->hasmask)
+			ExpandMaskRow(andbits + y * info->androw, width, row[kImageA]);
+		else
+			memset(row[kImageA], 255, width);
+	}
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+
+// the width the planes and the source row have room for; past the row width they must be left alone
+#define kTestMaxWidth 272
+#define kUntouched 0xA5
+
+// a pixel at a time, straight from the dib layout, for the row kernels to match
+static void ReferenceRow(const uint8_t *src, int width, int bpp, const uint32_t *palette, uint8_t *const *row)
+{
+	int j;
+	for (j = 0; j < width; j++) {
+		const uint8_t *colour;
+		switch (bpp) {
+		case 32:
+		case 24:
+			colour = src + j * (bpp / 8);
+			row[kImageR][j] = colour[2];
+			row[kImageG][j] = colour[1];
+			row[kImageB][j] = colour[0];
+			if (bpp == 32)
+				row[kImageA][j] = colour[3];
+			break;
+		case 8:
+		case 4:
+			colour = (const uint8_t *)&palette[bpp == 8 ? src[j] : (src[j / 2] >> (j % 2 ? 0 : 4)) & 15];
+			row[kImageR][j] = colour[0];
+			row[kImageG][j] = colour[1];
+			row[kImageB][j] = colour[2];
+			break;
+		case 1:
+			row[kImageA][j] = src[j / 8] & (0x80 >> (j % 8)) ? 0 : 255;
+			break;
+		}
+	}
+}
+
+static int CheckRow(const uint8_t *src, int width, int bpp, const uint32_t *palette)
+{
+	static uint8_t planes[2][kImagePlanes][kTestMaxWidth];
+	uint8_t *row[2][kImagePlanes];
+	int k, c;
+	
+	memset(planes, kUntouched, sizeof(planes));
+	for (k = 0; k < 2; k++)
+		for (c = 0; c < kImagePlanes; c++)
+			row[k][c] = planes[k][c];
+	switch (bpp) {
+	case 32:
+		ConvertRow32(src, width, row[0]);
+		break;
+	case 24:
+		ConvertRow24(src, width, row[0]);
+		break;
+	case 8:
+		ConvertRow8(src, width, palette, row[0]);
+		break;
+	case 4:
+		ConvertRow4(src, width, palette, row[0]);
+		break;
+	case 1:
+		ExpandMaskRow(src, width, row[0][kImageA]);
+		break;
+	}
+	ReferenceRow(src, width, bpp, palette, row[1]);
+	if (memcmp(planes[0], planes[1], sizeof(planes[0])) != 0) {
+		for (c = 0; c < kImagePlanes; c++) {
+			for (k = 0; k < kTestMaxWidth && planes[0][c][k] == planes[1][c][k]; k++)
+				;
+			if (k < kTestMaxWidth) {
+				fprintf(stderr, "%d bits, %d pixels: plane %d differs at %d (%d, should be %d)\n", bpp, width, c, k, planes[0][c][k], planes[1][c][k]);
+				break;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int depths[] = { 32, 24, 8, 4, 1 };
+	static const int widths[] = { 63, 64, 65, 127, 128, 129, 255, 256, 257 };
+	uint8_t src[4 * kTestMaxWidth];
+	uint32_t palette[256];
+	int errors = 0;
+	int i, j, k;
+	
+	srand(1);
+	for (k = 0; k < 256; k++)
+		palette[k] = rand() & 0xFFFFFF;	// r, g, b, 0 on a little-endian machine; only the first 3 bytes are compared
+	for (i = 0; i < sizeof(depths) / sizeof(int); i++) {
+		// every width across the 8 and 16 pixel vector steps, a few times over with different pixels
+		for (j = 0; j <= 40; j++) {
+			for (k = 0; k < sizeof(src); k++)
+				src[k] = rand();
+			errors += CheckRow(src, j, depths[i], palette);
+			// all bits set and all clear, for the mask
+			memset(src, j & 1 ? 0xFF : 0, sizeof(src));
+			errors += CheckRow(src, j, depths[i], palette);
+		}
+		for (j = 0; j < sizeof(widths) / sizeof(int); j++) {
+			for (k = 0; k < sizeof(src); k++)
+				src[k] = rand();
+			errors += CheckRow(src, widths[j], depths[i], palette);
+		}
+	}
+	
+	printf("%d error(s)\n", errors);
+	return errors != 0;
+}
+
+#endif
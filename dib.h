@@ -0,0 +1,34 @@
+#ifndef DIB_H
+#define DIB_H 1
+
+#include <stdint.h>
+#include "image.h"
+
+enum {
+	kDIBUnsupported = -1,	// compressed, or not 4, 8, 24 or 32 bits
+	kDIBTruncated = -2	// the colour bits don't fit in the icon resource
+};
+
+// what the BITMAPINFOHEADER of an icon resource says
+struct DIBInfo_ {
+	long infosize;	// header size; the palette follows it
+	int width;
+	int height;	// of the image, which is half the height in the header (the AND mask is the other half)
+	int bpp;
+	int ncolours;	// palette entries, 0 for 24 and 32 bits
+	long xorrow;	// bytes per row of the colour bits
+	long androw;	// bytes per row of the AND mask
+	int hasmask;	// whether the AND mask is there after the colour bits
+	int alphamask;	// whether the mask is the alpha channel (32-bit icons whose alpha isn't all 0)
+};
+typedef struct DIBInfo_ DIBInfo;
+
+// returns 0, kDIBUnsupported or kDIBTruncated; info is filled in as far as the header could be read
+int DIBGetInfo(const uint8_t *icon, long iconsize, DIBInfo *info);
+
+// decode rows first ... first + rows->height - 1 (counted from the top) into rows, which is info->width wide
+// 32-bit icons take the mask from their alpha channel, unless it's all 0 (old-style icon), and
+// the others from the AND mask (opaque if there's none)
+void DecodeDIB(const uint8_t *icon, const DIBInfo *info, int first, Image *rows);
+
+#endif
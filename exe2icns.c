@@ -0,0 +1,1124 @@
+/*
+	libexe2icns
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exe2icns.h"
+#include "icnsbuilder.h"
+#include "exereader.h"
+#include "taskpool.h"
+#include "png.h"
+#include "resample.h"
+#include "dib.h"
+#include "arena.h"
+
+#define DO_GAMMA_CORRECTION	1
+
+enum {
+	kIconResourceType = 3,
+	kIconGroupResourceType = 14,
+};
+
+enum {
+	kLCIDJapanese = 1041,
+};
+
+typedef signed char bool;
+
+static void Free(const Exe2ICNSContext *ctx, void *p)
+{
+	MemFree(&ctx->allocator, p);
+}
+
+// exe file field accessors
+// we can assume mem to be aligned
+static uint16_t Get16(const void *mem, long off)
+{
+	const uint8_t *p = mem;
+	p += off;
+	return p[0] + 256 * p[1];
+}
+static uint32_t Get32(const void *mem, long off)
+{
+	const uint8_t *p = mem;
+	p += off;
+	return p[0] + 256 * p[1] + 65536 * p[2] + 16777216U * p[3];
+}
+
+// the .rsrc section of an executable
+struct Resource_ {
+	ExeReader *reader;
+	long rawoff;	// file offset
+	long rawsize;
+	long virtualaddr;
+};
+typedef struct Resource_ Resource;
+
+// pointer to [off, off + len) of the section (off is relative to the section start)
+// NULL if the range sticks out of the section
+static const uint8_t * RsrcGet(const Resource *rs, long off, long len)
+{
+	if (off < 0 || len < 0 || off > rs->rawsize || len > rs->rawsize - off)
+		return NULL;
+	return ExeReaderGet(rs->reader, rs->rawoff + off, len);
+}
+
+// s must have room for 5 chars
+static const char * TagName(uint32_t tag, char *s)
+{
+	s[0] = tag >> 24;
+	s[1] = tag >> 16;
+	s[2] = tag >> 8;
+	s[3] = tag;
+	s[4] = 0;
+	return s;
+}
+
+/*
+	https://docs.microsoft.com/en-us/windows/win32/debug/pe-format
+	https://docs.microsoft.com/en-us/previous-versions/ms809762(v=msdn.10)#pe-file-resources
+*/
+
+/*
+	Windows Resource Structure
+	
+	Root dir -> Type dir -> Name dir -> Language dir
+	e.g.
+	Root -> Icon Group (14) -> 101 -> Japanese (1041)
+	
+	Resource Directory Table:
+	0/4	reserved
+	4/4	timestamp
+	8/2+2	major/minor version
+	12/2	# of named entries (1)
+	14/2	# of ID entries (2)
+	[followed by (1) + (2) resource directory entries]
+	
+	Resource Directory Entry:
+	0/4	name offset/ID
+	4/4	data entry offset (high bit 0)/subdirectory offset (high bit 1)
+	
+	Resource Directory String:
+	0/2	length
+	2/x	unicode characters
+	
+	Resource Data Entry
+	0/4	payload addr (addr when .rsrc is loaded into the virtual address)
+	4/4	payload size
+	8/4	codepage of resource
+	12/4	reserved
+*/
+
+static long ResourceFindIDEntry(const Resource *rs, long diroffset, int rsrcid)
+{
+	const uint8_t *p;
+	int namedcount, idcount;
+	int i;
+	const long kTableSize = 16;
+	const long kEntrySize = 8;
+	p = RsrcGet(rs, diroffset, kTableSize);
+	if (p == NULL)
+		return 0;
+	namedcount = Get16(p, 12);
+	idcount = Get16(p, 14);
+	p = RsrcGet(rs, diroffset + kTableSize, kEntrySize * (namedcount + idcount));
+	if (p == NULL)
+		return 0;
+	p += kEntrySize * namedcount;
+	for (i = 0; i < idcount; i++) {
+		uint32_t entryid = Get32(p, 0);
+		if (entryid & 0x80000000)	// this is a named resource
+			;
+		else if (entryid == rsrcid) {
+			// found
+			return Get32(p, 4);
+			break;
+		}
+		p += kEntrySize;
+	}
+	return 0;	// address 0 is regarded invalid
+}
+
+
+// index is 0-based
+static long ResourceFindIndEntry(const Resource *rs, long diroffset, int index)
+{
+	const uint8_t *p;
+	int namedcount, idcount;
+	const long kTableSize = 16;
+	const long kEntrySize = 8;
+	p = RsrcGet(rs, diroffset, kTableSize);
+	if (p == NULL)
+		return 0;
+	namedcount = Get16(p, 12);
+	idcount = Get16(p, 14);
+	if (index < namedcount + idcount) {
+		p = RsrcGet(rs, diroffset + kTableSize + kEntrySize * index, kEntrySize);
+		return p ? Get32(p, 4) : 0;
+	}
+	return 0;	// address 0 is regarded invalid
+}
+
+/*
+	Icon Group Resource
+	
+	https://devblogs.microsoft.com/oldnewthing/20120720-00/?p=7083
+	
+	GRPICONDIR:
+	0/2	reserved
+	2/2	type (1 = icon)
+	4/2	# of icons (n)
+	6/x	n * GRPICONDIRENTRY
+	
+	GRPICONDIRENTRY:
+	0/1	width
+	1/1	height
+	2/1	# of colours (0 if 256 colours or more)
+	3/1	reserved
+	4/2	# of planes (must be 1)
+	6/2	bit count
+	8/4	data size
+	12/2	id
+*/
+
+static long FindIcon(const Resource *rs, int id, int langcode, long *outaddr, long *outsize)
+{
+	const uint8_t *p;
+	long icondir;
+	long theicon;
+	long icondata;
+	long iconoff, iconsize;
+	
+	icondir = ResourceFindIDEntry(rs, 0, kIconResourceType);
+	if (icondir == 0) {
+		// no icon
+		return 0;
+	}
+	icondir &= 0x7FFFFFFF;	// assuming another directory
+	
+	theicon = ResourceFindIDEntry(rs, icondir, id);
+	if (theicon == 0) {
+		// can't find icon
+		return 0;
+	}
+	theicon &= 0x7FFFFFFF;		// assuming once again
+	
+	icondata = ResourceFindIDEntry(rs, theicon, langcode);
+	if (icondata == 0)
+		icondata = ResourceFindIndEntry(rs, theicon, 0);
+	if (icondata == 0) {
+		// can't find icon
+		return 0;
+	}
+	p = RsrcGet(rs, icondata, 16);
+	if (p == NULL)
+		return 0;
+	
+	iconoff = Get32(p, 0);
+	iconsize = Get32(p, 4);
+	
+	if (outaddr)
+		*outaddr = iconoff;
+	if (outsize)
+		*outsize = iconsize;
+	
+	return icondata;
+}
+
+static long FindIndIconGroup(const Resource *rs, int idx, int langcode, long *outaddr, long *outsize)
+{
+	const uint8_t *p;
+	long icongroupdir;
+	long thegroup;
+	long groupdata;
+	long groupoff, groupsize;
+	
+	icongroupdir = ResourceFindIDEntry(rs, 0, kIconGroupResourceType);
+	if (icongroupdir == 0) {
+		// no icon
+		return 0;
+	}
+	icongroupdir &= 0x7FFFFFFF;	// assuming another directory
+	
+	thegroup = ResourceFindIndEntry(rs, icongroupdir, idx);
+	if (thegroup == 0) {
+		// can't find icon group
+		return 0;
+	}
+	thegroup &= 0x7FFFFFFF;		// assuming once again
+	
+	groupdata = ResourceFindIDEntry(rs, thegroup, langcode);
+	if (groupdata == 0)
+		groupdata = ResourceFindIndEntry(rs, thegroup, 0);
+	if (groupdata == 0) {
+		// can't find icon group
+		return 0;
+	}
+	p = RsrcGet(rs, groupdata, 16);
+	if (p == NULL)
+		return 0;
+	
+	groupoff = Get32(p, 0);
+	groupsize = Get32(p, 4);
+	
+	if (outaddr)
+		*outaddr = groupoff;
+	if (outsize)
+		*outsize = groupsize;
+	
+	return groupdata;
+}
+
+static bool IsPNGTag(uint32_t tag)
+{
+	return tag == 'ic08'	// 256x256
+		|| tag == 'ic07'	// 128x256
+		|| tag == 'ic09'	// 512x512
+		|| tag == 'ic10'	// 1024x1024 (512x512@2x)
+		|| tag == 'ic11'	// 32x32 (16x16@2x)
+		|| tag == 'ic12'	// 64x64 (32x32@2x)
+		|| tag == 'ic13'	// 256x256 (128x128@2x)
+		|| tag == 'ic14'	// 512x512 (256x256@2x)
+		;
+}
+
+// read the size from the IHDR of png data without decoding it; returns 0 if it isn't png
+static bool GetPNGSize(const uint8_t *data, long size, int *width, int *height)
+{
+	uint32_t w, h;
+	if (size < 24 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0)
+		return 0;
+	w = (uint32_t)data[16] << 24 | data[17] << 16 | data[18] << 8 | data[19];
+	h = (uint32_t)data[20] << 24 | data[21] << 16 | data[22] << 8 | data[23];
+	if (w > 65535 || h > 65535)
+		return 0;
+	*width = w;
+	*height = h;
+	return 1;
+}
+
+// the @2x element that is the same image as an icon of this size
+static uint32_t RetinaTagForSize(int width, int height)
+{
+	if (width != height)
+		return 0;
+	return width == 32 ? 'ic11'
+		: width == 256 ? 'ic13'
+		: width == 512 ? 'ic14'
+		: 0;
+}
+
+enum {
+	kMaxIconJobs = 16
+};
+
+// the settings kExe2ICNSCompressSmallest tries for every png element: each filter choice with each zlib strategy
+static const PNGOptions kPNGCandidates[] = {
+	{ kPNGFilterAdaptive, 9, 9, kPNGStrategyDefault },
+	{ kPNGFilterAdaptive, 9, 9, kPNGStrategyFiltered },
+	{ kPNGFilterAdaptive, 9, 9, kPNGStrategyRLE },
+	{ 0, 9, 9, kPNGStrategyDefault },	// none
+	{ 0, 9, 9, kPNGStrategyFiltered },
+	{ 0, 9, 9, kPNGStrategyRLE },
+	{ 1, 9, 9, kPNGStrategyDefault },	// sub
+	{ 1, 9, 9, kPNGStrategyFiltered },
+	{ 1, 9, 9, kPNGStrategyRLE },
+	{ 2, 9, 9, kPNGStrategyDefault },	// up
+	{ 2, 9, 9, kPNGStrategyFiltered },
+	{ 2, 9, 9, kPNGStrategyRLE },
+	{ 3, 9, 9, kPNGStrategyDefault },	// average
+	{ 3, 9, 9, kPNGStrategyFiltered },
+	{ 3, 9, 9, kPNGStrategyRLE },
+	{ 4, 9, 9, kPNGStrategyDefault },	// paeth
+	{ 4, 9, 9, kPNGStrategyFiltered },
+	{ 4, 9, 9, kPNGStrategyRLE },
+};
+
+enum {
+	kPNGCandidateCount = sizeof(kPNGCandidates) / sizeof(PNGOptions)
+};
+
+// Z_RLE was no faster than this on real icons, and several times bigger
+static const PNGOptions kFastPNGOptions = { kPNGFilterAdaptive, 2, 8, kPNGStrategyDefault };
+
+// one element (plus its mask) of the icns being built
+struct IconJob_ {
+	uint32_t tag;
+	uint32_t masktag;	// 0 for png elements
+	int width;
+	int height;
+	int bpp;
+	const uint8_t *icon;	// icon resource payload; NULL for the synthesized icon
+	long iconsize;
+	const struct IconJob_ *source;	// decoded icon the synthesized one is scaled from
+	bool passthrough;	// png copied as it is
+	bool needpixels;	// decode the whole image even for passed-through png or a png element, as the source of a synthesized icon
+	bool streamed;	// png element encoded from the dib rows as they're decoded, never decoded whole
+	uint32_t retinatag;	// @2x element that gets a copy of the png payload, or 0
+	// decoded pixels; stays empty for passed-through png
+	Image image;
+	// encoded element data; RLE elements are compressed straight into the builder instead
+	uint8_t *data;
+	long datasize;
+	// png made with each of kPNGCandidates, until the smallest becomes data
+	uint8_t *candidates[kPNGCandidateCount];
+	long candidatesizes[kPNGCandidateCount];
+};
+typedef struct IconJob_ IconJob;
+
+// all the elements of one icns
+// jobs are encoded in any order (possibly on several threads) but always added to the icns in index order
+struct IconSet_ {
+	const Exe2ICNSContext *ctx;
+	IconJob jobs[kMaxIconJobs];
+	int njobs;
+	int order[kMaxIconJobs];	// job indices, largest image first, so that the slowest one starts first
+};
+typedef struct IconSet_ IconSet;
+
+// decode job->icon into job->image, unless nothing is scaled from it and it's a png to be passed through,
+// or a dib going into a png element, which EncodeIcon decodes band by band
+static void DecodeIcon(const Exe2ICNSContext *ctx, IconJob *job)
+{
+	const uint8_t *icon = job->icon;
+	long iconsize = job->iconsize;
+	Image *image = &job->image;
+	
+	if (memcmp(icon, "\x89PNG", 4) == 0) {
+		PNGDecodeOptions decode;
+		decode.crc = ctx->pngcrc;
+		job->passthrough = IsPNGTag(job->tag);
+		if (job->passthrough && ! job->needpixels) {
+			// passed through as it is by AddIconElements
+		}
+		else if (ExpandPNG(icon, iconsize, &decode, image, ctx) == 0 && (image->width != job->width || image->height != job->height)) {
+			LogMessage(ctx, kExe2ICNSLogWarning, "png is %d x %d, not %d x %d", image->width, image->height, job->width, job->height);
+			ImageFree(image, &ctx->allocator);
+		}
+	}
+	else {
+		DIBInfo info;
+		int r = DIBGetInfo(icon, iconsize, &info);
+		if (r == 0 && (info.width != job->width || info.height != job->height)) {
+			LogMessage(ctx, kExe2ICNSLogWarning, "dib is %d x %d, not %d x %d", info.width, info.height, job->width, job->height);
+		}
+		else if (r == 0) {
+			job->bpp = info.bpp;
+			if (IsPNGTag(job->tag) && ! job->needpixels)
+				job->streamed = 1;
+			else if (ImageAlloc(image, info.width, info.height, &ctx->allocator) == 0)
+				DecodeDIB(icon, &info, 0, image);
+		}
+		else if (r == kDIBUnsupported) {
+			LogMessage(ctx, kExe2ICNSLogWarning, "%d-bit dib is unsupported", info.bpp);
+		}
+		else {
+			LogMessage(ctx, kExe2ICNSLogWarning, "dib is truncated");
+		}
+	}
+}
+
+// synthesize a missing size (osx-standard 128x128 etc.) by scaling job->source down
+// job->source is read where it was decoded, so it must be left alone until every job is encoded
+static void SynthesizeIcon(const Exe2ICNSContext *ctx, IconJob *job)
+{
+	const IconJob *source = job->source;
+	int width = job->width;
+	int height = job->height;
+	char tagname[5];
+	Image *image = &job->image;
+	
+	if (source->image.planes[0] == NULL)
+		return;
+	if (ImageAlloc(image, width, height, &ctx->allocator) != 0)
+		return;
+	LogMessage(ctx, kExe2ICNSLogInfo, "synthesizing %d x %d icon [%s] from %d x %d...", width, height, TagName(job->tag, tagname), source->width, source->height);
+	if (ctx->filter == kExe2ICNSFilterBox && source->width == 2 * width && source->height == 2 * height) {
+#if DO_GAMMA_CORRECTION
+		// outgamma should actually be 1.8, but other images aren't doing gamma correction
+		HalveImage(&source->image, image);
+#else
+		int i, j, c;
+		int w2 = 2 * width;
+		for (c = 0; c < kImagePlanes; c++) {
+			const uint8_t *p = source->image.planes[c];
+			uint8_t *q = image->planes[c];
+			for (i = 0; i < height; i++) {
+				for (j = 0; j < width; j++) {
+					uint8_t v1 = p[(i*2)*w2+(j*2)];
+					uint8_t v2 = p[(i*2)*w2+(j*2+1)];
+					uint8_t v3 = p[(i*2+1)*w2+(j*2)];
+					uint8_t v4 = p[(i*2+1)*w2+(j*2+1)];
+					q[i*width+j] = (v1 + v2 + v3 + v4 + 2) / 4;
+				}
+			}
+		}
+#endif
+	}
+	else if (ResampleImage(ctx->filter, &source->image, image, &ctx->allocator) != 0) {
+		ImageFree(image, &ctx->allocator);
+		return;
+	}
+}
+
+// dib being encoded to png a band at a time
+struct DIBRows_ {
+	const uint8_t *icon;
+	DIBInfo info;
+};
+typedef struct DIBRows_ DIBRows;
+
+static void DecodeDIBRows(void *ctx, int first, Image *band)
+{
+	DIBRows *dib = ctx;
+	DecodeDIB(dib->icon, &dib->info, first, band);
+}
+
+// whether job is a png element that has to be encoded; RLE elements and passed-through png are left to AddIconElements
+static bool NeedsPNGEncoding(const IconJob *job)
+{
+	return IsPNGTag(job->tag) && (job->streamed || (job->image.planes[0] && ! job->passthrough));
+}
+
+static uint8_t * EncodePNGElement(const Exe2ICNSContext *ctx, const IconJob *job, const PNGOptions *options, long *size)
+{
+	if (job->streamed) {
+		DIBRows dib;
+		dib.icon = job->icon;
+		DIBGetInfo(job->icon, job->iconsize, &dib.info);
+		return CompressRowsToPNG(job->width, job->height, DecodeDIBRows, &dib, options, size, ctx);
+	}
+	return CompressToPNG(&job->image, options, size, ctx);
+}
+
+// the compression that is actually done: with an encoder that ignores PNGOptions, every candidate
+// of kExe2ICNSCompressSmallest would be the same png
+static int Compression(const Exe2ICNSContext *ctx)
+{
+	if (ctx->compression != kExe2ICNSCompressDefault && ! PNGEncoderTakesOptions())
+		return kExe2ICNSCompressDefault;
+	return ctx->compression;
+}
+
+// fill job->data with the png element
+// with kExe2ICNSCompressSmallest, the candidates are encoded as tasks of their own, see PNGCandidateTask
+static void EncodeIcon(const Exe2ICNSContext *ctx, IconJob *job)
+{
+	if (! NeedsPNGEncoding(job) || Compression(ctx) == kExe2ICNSCompressSmallest)
+		return;
+	job->data = EncodePNGElement(ctx, job, Compression(ctx) == kExe2ICNSCompressFast ? &kFastPNGOptions : NULL, &job->datasize);
+}
+
+// keep the smallest candidate as job->data; ties go to the earlier candidate, so the result doesn't depend on the threads
+static void PickPNGCandidate(const Exe2ICNSContext *ctx, IconJob *job)
+{
+	int best = -1;
+	int i;
+	char tagname[5];
+	for (i = 0; i < kPNGCandidateCount; i++) {
+		if (job->candidates[i] && (best < 0 || job->candidatesizes[i] < job->candidatesizes[best]))
+			best = i;
+	}
+	if (best >= 0) {
+		LogMessage(ctx, kExe2ICNSLogInfo, "smallest png for %s: %ld bytes (filter %d, strategy %d)", TagName(job->tag, tagname), job->candidatesizes[best], kPNGCandidates[best].filter, kPNGCandidates[best].strategy);
+		job->data = job->candidates[best];
+		job->datasize = job->candidatesizes[best];
+	}
+	for (i = 0; i < kPNGCandidateCount; i++) {
+		if (i != best)
+			Free(ctx, job->candidates[i]);
+		job->candidates[i] = NULL;
+	}
+}
+
+// bytes job will take in the builder's buffer at most, element headers included
+// passed-through png is only referenced when there's a sink, so its payload doesn't count then
+static long IconElementsSizeBound(const IconJob *job, bool copied)
+{
+	long npixels = job->width * job->height;
+	long passthrough = copied ? job->iconsize : 0;
+	long bound = job->retinatag ? 8 + passthrough : 0;
+	if (IsPNGTag(job->tag))
+		return bound + 8 + (job->data ? job->datasize : passthrough);
+	else if (job->image.planes[0])
+		return bound + 8 + ICNSCompressedSizeBound(job->tag, npixels) + (job->masktag ? 8 + npixels : 0);
+	return bound;
+}
+
+static void RecordElement(Exe2ICNSOutput *out, const IconJob *job, uint32_t tag, long offset, long size, int flags)
+{
+	Exe2ICNSElement *el;
+	if (out == NULL || out->nelements >= kExe2ICNSMaxElements)
+		return;
+	el = &out->elements[out->nelements++];
+	el->tag = tag;
+	el->offset = offset;
+	el->size = size;
+	el->width = job->width;
+	el->height = job->height;
+	el->sourcebpp = job->icon ? job->bpp : 0;
+	el->flags = flags | (job->icon ? 0 : kExe2ICNSElementSynthesized);
+}
+
+// add the element (and its mask) for job to the builder; returns 0 or a kICNS error
+// RLE is cheap next to deflate, so it's done here, into the builder's buffer, rather than on the workers
+static int AddIconElements(const Exe2ICNSContext *ctx, ICNSBuilder *builder, const IconJob *job, Exe2ICNSOutput *out)
+{
+	long npixels = job->width * job->height;
+	long off = ICNSBuilderGetSize(builder);
+	int r = 0;
+	if (IsPNGTag(job->tag)) {
+		if (job->data) {
+			r = ICNSAddData(builder, job->tag, job->data, job->datasize);
+			if (r == 0)
+				RecordElement(out, job, job->tag, off, ICNSBuilderGetSize(builder) - off, kExe2ICNSElementPNG);
+		}
+		else if (job->passthrough) {
+			char tagname[5];
+			LogMessage(ctx, kExe2ICNSLogInfo, "passing through the png data for %s", TagName(job->tag, tagname));
+			r = ICNSAddReference(builder, job->tag, job->icon, job->iconsize);
+			if (r == 0)
+				RecordElement(out, job, job->tag, off, ICNSBuilderGetSize(builder) - off, kExe2ICNSElementPNG | kExe2ICNSElementPassedThrough);
+		}
+	}
+	else if (job->image.planes[0]) {
+		void *p = ICNSBeginData(builder, job->tag, ICNSCompressedSizeBound(job->tag, npixels));
+		long size = -1;
+		if (p == NULL)
+			return kICNSOutOfMemory;
+		size = ICNSCompressImage(job->tag, &job->image, p);
+		r = ICNSEndData(builder, size);
+		if (r != 0)
+			return r;
+		RecordElement(out, job, job->tag, off, ICNSBuilderGetSize(builder) - off, 0);
+		if (job->masktag) {
+			off = ICNSBuilderGetSize(builder);
+			r = ICNSAddData(builder, job->masktag, job->image.planes[kImageA], npixels);
+			if (r == 0)
+				RecordElement(out, job, job->masktag, off, ICNSBuilderGetSize(builder) - off, kExe2ICNSElementMask);
+		}
+	}
+	if (r == 0 && job->retinatag) {
+		off = ICNSBuilderGetSize(builder);
+		r = ICNSAddReference(builder, job->retinatag, job->icon, job->iconsize);
+		if (r == 0)
+			RecordElement(out, job, job->retinatag, off, ICNSBuilderGetSize(builder) - off, kExe2ICNSElementPNG | kExe2ICNSElementPassedThrough);
+	}
+	return r;
+}
+
+static void DecodeIconTask(void *ctx, long index, int worker)
+{
+	IconSet *set = ctx;
+	IconJob *job = &set->jobs[set->order[index]];
+	if (job->icon)
+		DecodeIcon(set->ctx, job);
+}
+
+static void EncodeIconTask(void *ctx, long index, int worker)
+{
+	IconSet *set = ctx;
+	IconJob *job = &set->jobs[set->order[index]];
+	if (job->icon == NULL)
+		SynthesizeIcon(set->ctx, job);
+	EncodeIcon(set->ctx, job);
+}
+
+// one candidate of one png element; the candidates of a job all run at once when there are threads for them
+static void PNGCandidateTask(void *ctx, long index, int worker)
+{
+	IconSet *set = ctx;
+	IconJob *job = &set->jobs[set->order[index / kPNGCandidateCount]];
+	int i = index % kPNGCandidateCount;
+	if (NeedsPNGEncoding(job))
+		job->candidates[i] = EncodePNGElement(set->ctx, job, &kPNGCandidates[i], &job->candidatesizes[i]);
+}
+
+struct IconSize_ {
+	int size;
+	uint32_t tag;
+	uint32_t masktag;
+};
+typedef struct IconSize_ IconSize;
+
+static void SortJobsBySize(IconSet *set)
+{
+	int i, j;
+	for (i = 0; i < set->njobs; i++) {
+		int k = i;
+		long size = (long)set->jobs[k].width * set->jobs[k].height;
+		for (j = i; j > 0; j--) {
+			const IconJob *prev = &set->jobs[set->order[j - 1]];
+			if ((long)prev->width * prev->height >= size)
+				break;
+			set->order[j] = set->order[j - 1];
+		}
+		set->order[j] = k;
+	}
+}
+
+static IconJob * AddIconJob(IconSet *set, uint32_t tag, uint32_t masktag, int width, int height, int bpp)
+{
+	IconJob *job;
+	if (set->njobs >= kMaxIconJobs)
+		return NULL;
+	job = &set->jobs[set->njobs++];
+	memset(job, 0, sizeof(IconJob));
+	job->tag = tag;
+	job->masktag = masktag;
+	job->width = width;
+	job->height = height;
+	job->bpp = bpp;
+	return job;
+}
+
+// the sizes that can be made by scaling a bigger icon down
+static const IconSize kSynthesizedSizes[] = {
+	{ 16, 'is32', 's8mk' },
+	{ 32, 'il32', 'l8mk' },
+	{ 48, 'ih32', 'h8mk' },
+	{ 128, 'it32', 't8mk' },
+	{ 256, 'ic08', 0 },
+};
+
+// add a job for every missing size, scaled from the smallest icon that is bigger
+// the synthesized icons are decoded along with the others; see EncodeIconTask
+static void AddSynthesizedJobs(IconSet *set)
+{
+	int nicons = set->njobs;
+	int i, j;
+	for (i = 0; i < sizeof(kSynthesizedSizes) / sizeof(IconSize); i++) {
+		int size = kSynthesizedSizes[i].size;
+		IconJob *source = NULL;
+		IconJob *job;
+		for (j = 0; j < nicons; j++) {
+			IconJob *icon = &set->jobs[j];
+			if (icon->width == size && icon->height == size)
+				break;
+			if (icon->width > size && icon->height > size && (source == NULL || icon->width * icon->height < source->width * source->height))
+				source = icon;
+		}
+		if (j < nicons || source == NULL)
+			continue;
+		job = AddIconJob(set, kSynthesizedSizes[i].tag, kSynthesizedSizes[i].masktag, size, size, 32);
+		if (job) {
+			job->source = source;
+			source->needpixels = 1;
+		}
+	}
+}
+
+// whether the icon group has an entry of width x height with 8 or more bits
+static bool HasDeepIcon(const uint8_t *entries, int count, int width, int height)
+{
+	int i;
+	for (i = 0; i < count; i++, entries += 14) {
+		int w = entries[0] == 0 ? 256 : entries[0];
+		int h = entries[1] == 0 ? 256 : entries[1];
+		if (w == width && h == height && Get16(entries, 6) >= 8)
+			return 1;
+	}
+	return 0;
+}
+
+// the payload of icon id, or NULL if it isn't there
+static const uint8_t * GetIconData(const Exe2ICNSContext *ctx, const Resource *rs, int id, int langcode, long *outsize)
+{
+	long iconoff;
+	long iconsize;
+	const uint8_t *icon;
+	
+	if (FindIcon(rs, id, langcode, &iconoff, &iconsize) == 0)
+		return NULL;
+	iconoff -= rs->virtualaddr;
+	LogMessage(ctx, kExe2ICNSLogInfo, "icon data at %08lX, length %08lX", iconoff, iconsize);
+	icon = RsrcGet(rs, iconoff, iconsize);
+	if (icon == NULL || iconsize < 40) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "icon data is out of the .rsrc section");
+		return NULL;
+	}
+	*outsize = iconsize;
+	return icon;
+}
+
+// the decoding and encoding of each size runs on up to ctx->nthreads threads
+// the icns is written to sink element by element, or kept in out->data without a sink
+static int ExtractMainIconAsICNSFromResource(const Exe2ICNSContext *ctx, const Resource *rs, ICNSSink *sink, Exe2ICNSOutput *out)
+{
+	int langcode = kLCIDJapanese;
+	long groupdata;	// offset to icon group resource data entry
+	long groupoff;	// offset to the actual payload
+	long groupsize;	// size of the payload
+	int result = kExe2ICNSNoIcon;
+	
+	groupdata = FindIndIconGroup(rs, 0, langcode, &groupoff, &groupsize);
+	
+	if (groupdata == 0) {
+		return kExe2ICNSNoIcon;
+	}
+	
+	groupoff -= rs->virtualaddr;
+	
+	// icon group found
+	// parse icon group resource
+	{
+		const uint8_t *q = RsrcGet(rs, groupoff, groupsize);
+		const uint8_t *entries;
+		int count;
+		int i;
+		bool done1024 = 0, done512 = 0, done256 = 0, done128 = 0, done64 = 0, done48 = 0, done32 = 0, done16 = 0;
+		IconSet set;
+		ICNSBuilder builder;
+		
+		if (q == NULL || groupsize < 6) {
+			LogMessage(ctx, kExe2ICNSLogWarning, "icon group is out of the .rsrc section");
+			return kExe2ICNSNoIcon;
+		}
+		count = Get16(q, 4);
+		if (6 + 14 * count > groupsize)
+			count = (groupsize - 6) / 14;
+		
+		set.ctx = ctx;
+		set.njobs = 0;
+		q += 6;
+		entries = q;
+		// pick the icons; the resource is only touched here, never from the worker threads
+		for (i = 0; i < count; i++) {
+			int id = Get16(q, 12);
+			int width = q[0] == 0 ? 256 : (uint8_t)q[0];
+			int height = q[1] == 0 ? 256 : (uint8_t)q[1];
+			int bpp = Get16(q, 6);
+			const uint8_t *icon = NULL;
+			long iconsize = 0;
+			bool fetched = 0;
+			uint32_t tag = 0;
+			uint32_t masktag = 0;
+			// a 4-bit icon only stands in for a size that has nothing deeper
+			bool usable = bpp >= 8 || (bpp == 4 && ! HasDeepIcon(entries, count, width, height));
+			
+			// 0 in the group entry means 256 or more; a png has the real size in its header
+			if (width == 256 && height == 256 && usable) {
+				icon = GetIconData(ctx, rs, id, langcode, &iconsize);
+				fetched = 1;
+				if (icon)
+					GetPNGSize(icon, iconsize, &width, &height);
+			}
+			
+			if (width == 1024 && height == 1024 && usable) {
+				if (! done1024) {
+					tag = 'ic10';
+					done1024 = 1;
+				}
+			}
+			else if (width == 512 && height == 512 && usable) {
+				if (! done512) {
+					tag = 'ic09';
+					done512 = 1;
+				}
+			}
+			else if (width == 256 && height == 256 && usable) {
+				if (! done256) {
+					tag = 'ic08';
+					done256 = 1;
+				}
+			}
+			else if (width == 128 && height == 128 && usable) {
+				if (! done128) {
+					tag = 'it32';
+					masktag = 't8mk';
+					done128 = 1;
+				}
+			}
+			else if (width == 64 && height == 64 && usable) {
+				if (! done64) {
+					tag = 'ic12';
+					done64 = 1;
+				}
+			}
+			else if (width == 48 && height == 48 && usable) {
+				if (! done48) {
+					tag = 'ih32';
+					masktag = 'h8mk';
+					done48 = 1;
+				}
+			}
+			else if (width == 32 && height == 32 && usable) {
+				if (! done32) {
+					tag = 'il32';
+					masktag = 'l8mk';
+					done32 = 1;
+				}
+			}
+			else if (width == 16 && height == 16 && usable) {
+				if (! done16) {
+					tag = 'is32';
+					masktag = 's8mk';
+					done16 = 1;
+				}
+			}
+			//else if (width == 16 && height == 12) {
+			//	tag = 'icm8';
+			//}
+			
+			if (tag != 0) {
+				char tagname[5];
+				IconJob *job;
+				LogMessage(ctx, kExe2ICNSLogInfo, "processing icon: %d x %d, %d bit(s) > '%s'", width, height, bpp, TagName(tag, tagname));
+				if (! fetched)
+					icon = GetIconData(ctx, rs, id, langcode, &iconsize);
+				if (icon && (job = AddIconJob(&set, tag, masktag, width, height, bpp)) != NULL) {
+					job->icon = icon;
+					job->iconsize = iconsize;
+					// png is copied into the @2x element as it is
+					if (ctx->retina && memcmp(icon, "\x89PNG", 4) == 0)
+						job->retinatag = RetinaTagForSize(width, height);
+				}
+			}
+			else {
+				LogMessage(ctx, kExe2ICNSLogInfo, "skipping icon: %d x %d, %d bit(s)", width, height, bpp);
+			}
+			q += 14;
+		}
+		
+		if (ctx->synthesize)
+			AddSynthesizedJobs(&set);
+		
+		// do extraction
+		SortJobsBySize(&set);
+		RunTasks(set.njobs, ctx->nthreads, DecodeIconTask, &set);
+		
+		SortJobsBySize(&set);
+		RunTasks(set.njobs, ctx->nthreads, EncodeIconTask, &set);
+		
+		if (Compression(ctx) == kExe2ICNSCompressSmallest) {
+			RunTasks(set.njobs * kPNGCandidateCount, ctx->nthreads, PNGCandidateTask, &set);
+			for (i = 0; i < set.njobs; i++)
+				PickPNGCandidate(ctx, &set.jobs[i]);
+		}
+		
+		// put the elements together in a fixed order, no matter which one finished first
+		// when the sink can't be rewound, the container (passed-through png aside) is kept whole and allocated once, big enough for every element
+		{
+			long bound = 8;
+			int r;
+			for (i = 0; i < set.njobs; i++)
+				bound += IconElementsSizeBound(&set.jobs[i], sink == NULL);
+			r = ICNSBuilderInitWithSink(&builder, sink, &ctx->allocator);
+			if (r == 0)
+				r = ICNSBuilderReserve(&builder, bound);
+			for (i = 0; i < set.njobs; i++) {
+				IconJob *job = &set.jobs[i];
+				if (r == 0)
+					r = AddIconElements(ctx, &builder, job, out);
+				ImageFree(&job->image, &ctx->allocator);
+				Free(ctx, job->data);
+			}
+			if (r == 0)
+				r = ICNSBuilderFinish(&builder);
+			result = r == 0 ? kExe2ICNSSuccess : r == kICNSWriteError ? kExe2ICNSWriteError : kExe2ICNSOutOfMemory;
+		}
+		if (result == kExe2ICNSSuccess) {
+			out->size = ICNSBuilderGetSize(&builder);
+			if (sink == NULL)
+				out->data = ICNSBuilderDetachData(&builder);
+		}
+		ICNSBuilderTerminate(&builder);
+	}
+	return result;
+}
+
+// find the .rsrc section of the executable and convert its icon
+static int ConvertExe(const Exe2ICNSContext *ctx, ExeReader *reader, ICNSSink *sink, Exe2ICNSOutput *out)
+{
+	const char *exe;
+	int result = 0;
+	long peoff;
+	int nsecs;
+	int opthdrsize;
+	long sectableoff;
+	int i;
+	Resource rs;
+	
+	exe = ExeReaderGet(reader, 0, 64);
+	if (exe == NULL || Get16(exe, 0) != 0x5A4D) {	// 'MZ'
+		result = kExe2ICNSInvalidFile;
+		LogMessage(ctx, kExe2ICNSLogError, "no MZ signature");
+		return result;
+	}
+	peoff = Get32(exe, 60);
+	exe = ExeReaderGet(reader, peoff, 4 + 20);
+	if (exe == NULL || Get32(exe, 0) != 0x00004550) {	// 'PE\0\0'
+		result = kExe2ICNSInvalidFile;
+		LogMessage(ctx, kExe2ICNSLogError, "no PE signature at %lX", peoff);
+		return result;
+	}
+	
+	nsecs = Get16(exe, 4 + 2);
+	opthdrsize = Get16(exe, 4 + 16);
+	exe = ExeReaderGet(reader, peoff + 4 + 20, opthdrsize);
+	if (exe == NULL || opthdrsize < 40) {
+		result = kExe2ICNSInvalidFile;
+		LogMessage(ctx, kExe2ICNSLogError, "optional header is truncated");
+		return result;
+	}
+	// the 32-bit and 64-bit optional headers differ in size only, which the file header gives
+	sectableoff = peoff + 4 + 20 + opthdrsize;
+	
+	// find .rsrc section
+	result = kExe2ICNSNoIcon;
+	rs.reader = reader;
+	for (i = 0; i < nsecs; i++) {
+		const int sechdrsize = 40;
+		long sechdroff = sectableoff + i * sechdrsize;
+		const char *sechdr = ExeReaderGet(reader, sechdroff, sechdrsize);
+		if (sechdr == NULL) {
+			LogMessage(ctx, kExe2ICNSLogWarning, "section table is truncated");
+			break;
+		}
+		LogMessage(ctx, kExe2ICNSLogInfo, "[%.8s section header at %08lX]", sechdr, sechdroff);
+		if (strncmp(sechdr, ".rsrc", 8) == 0) {
+			// found
+			rs.virtualaddr = Get32(sechdr, 12);
+			rs.rawoff = Get32(sechdr, 20);
+			rs.rawsize = Get32(sechdr, 16);
+			LogMessage(ctx, kExe2ICNSLogInfo, "[.rsrc offset %08lX / size %08lX / virtualaddr %08lX]", rs.rawoff, rs.rawsize, rs.virtualaddr);
+			if (rs.rawoff > reader->size || rs.rawsize > reader->size - rs.rawoff) {
+				LogMessage(ctx, kExe2ICNSLogError, ".rsrc section exceeds the file size");
+				result = kExe2ICNSInvalidFile;
+				return result;
+			}
+			result = ExtractMainIconAsICNSFromResource(ctx, &rs, sink, out);
+			break;
+		}
+	}
+	
+	if (result == kExe2ICNSNoIcon)
+		LogMessage(ctx, kExe2ICNSLogError, "no icon data in executable");
+	else if (result == kExe2ICNSOutOfMemory)
+		LogMessage(ctx, kExe2ICNSLogError, "out of memory");
+	else if (result == kExe2ICNSWriteError)
+		LogMessage(ctx, kExe2ICNSLogError, "can't write the icns data");
+	
+	return result;
+}
+
+static void * DefaultAlloc(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+static void * DefaultResize(void *ctx, void *p, size_t size)
+{
+	return realloc(p, size);
+}
+
+static void DefaultFree(void *ctx, void *p)
+{
+	free(p);
+}
+
+static void DefaultLog(void *ctx, int level, const char *message)
+{
+	fprintf(stderr, "%s\n", message);
+}
+
+void Exe2ICNSInitContext(Exe2ICNSContext *ctx)
+{
+	// shared tables are set up here, only the first time
+	InitPNGCodec();
+	ctx->allocator.alloc = DefaultAlloc;
+	ctx->allocator.resize = DefaultResize;
+	ctx->allocator.free = DefaultFree;
+	ctx->allocator.ctx = NULL;
+	ctx->log = DefaultLog;
+	ctx->logctx = NULL;
+	ctx->synthesize = 1;
+	ctx->filter = kExe2ICNSFilterBox;
+	ctx->compression = kExe2ICNSCompressDefault;
+	ctx->pngcrc = kExe2ICNSCRCAll;
+	ctx->retina = 0;
+	ctx->nthreads = 1;
+	ctx->inputmode = kExe2ICNSInputMap;
+}
+
+static void ClearOutput(Exe2ICNSOutput *out)
+{
+	out->data = NULL;
+	out->size = 0;
+	out->nelements = 0;
+	out->bytesread = 0;
+}
+
+int Exe2ICNSConvert(const Exe2ICNSContext *ctx, const void *exe, long exesize, Exe2ICNSOutput *out)
+{
+	ExeReader reader;
+	int result;
+	
+	ClearOutput(out);
+	ExeReaderOpenMemory(&reader, exe, exesize);
+	result = ConvertExe(ctx, &reader, NULL, out);
+	if (result != kExe2ICNSSuccess)
+		Exe2ICNSFreeOutput(ctx, out);
+	out->bytesread = reader.bytesread;
+	ExeReaderClose(&reader);
+	return result;
+}
+
+int Exe2ICNSConvertFile(const Exe2ICNSContext *ctx, FILE *ifp, FILE *ofp, Exe2ICNSOutput *out)
+{
+	ExeReader reader;
+	ICNSSink sink;
+	Exe2ICNSOutput tmp;
+	int result;
+	
+	if (out == NULL)
+		out = &tmp;
+	ClearOutput(out);
+	// the reader modes are the same as kExe2ICNSInput...
+	if (ExeReaderOpen(&reader, ifp, ctx->inputmode, ctx) != 0) {
+		LogMessage(ctx, kExe2ICNSLogError, "can't read the executable");
+		return kExe2ICNSInvalidFile;
+	}
+	// write through the descriptor so element payloads go out with writev, straight from the mapping
+	if (fflush(ofp) == 0 && fileno(ofp) >= 0)
+		ICNSSinkInitFD(&sink, fileno(ofp));
+	else
+		ICNSSinkInitFile(&sink, ofp);
+	result = ConvertExe(ctx, &reader, &sink, out);
+	if (result != kExe2ICNSSuccess)
+		out->nelements = 0;	// what was written before the error isn't an icns
+	if (reader.mode == kReaderSelective)
+		LogMessage(ctx, kExe2ICNSLogInfo, "[read %ld of %ld bytes]", reader.bytesread, reader.size);
+	out->bytesread = reader.bytesread;
+	ExeReaderClose(&reader);
+	return result;
+}
+
+void Exe2ICNSFreeOutput(const Exe2ICNSContext *ctx, Exe2ICNSOutput *out)
+{
+	Free(ctx, out->data);
+	out->data = NULL;
+	out->size = 0;
+	// the elements were offsets into data
+	out->nelements = 0;
+}
+
+const char * Exe2ICNSResultString(int result)
+{
+	switch (result) {
+	case kExe2ICNSSuccess:
+		return "ok";
+	case kExe2ICNSInvalidFile:
+		return "not a valid executable";
+	case kExe2ICNSNoIcon:
+		return "no icon";
+	case kExe2ICNSWriteError:
+		return "can't write the icns";
+	case kExe2ICNSOutOfMemory:
+		return "out of memory";
+	}
+	return "unknown error";
+}
@@ -0,0 +1,148 @@
+#ifndef EXE2ICNS_H
+#define EXE2ICNS_H 1
+
+/*
+	libexe2icns: converts the main icon of a Windows executable into a Mac OS X icns
+
+	all the state lives in the context and the output, so any number of conversions can run at once
+	as long as each thread has its own output (a context can be shared once it's set up)
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the library is built with -fvisibility=hidden; only these functions are exported
+#if defined(__GNUC__)
+#define EXE2ICNS_API __attribute__((visibility("default")))
+#else
+#define EXE2ICNS_API
+#endif
+
+// results
+enum {
+	kExe2ICNSSuccess = 0,
+	kExe2ICNSInvalidFile = 101,	// not a PE executable, or truncated
+	kExe2ICNSNoIcon = 102,	// nothing has been written
+	kExe2ICNSWriteError = 103,
+	kExe2ICNSOutOfMemory = 105
+};
+
+// how Exe2ICNSConvertFile brings the executable into memory
+enum {
+	kExe2ICNSInputMap = 0,	// mmap (read for pipes etc.)
+	kExe2ICNSInputRead = 1,	// read the whole file
+	kExe2ICNSInputSelective = 2	// pread only the parts that are looked at
+};
+
+// log message levels
+enum {
+	kExe2ICNSLogInfo = 0,	// progress
+	kExe2ICNSLogWarning = 1,	// something in the executable is skipped
+	kExe2ICNSLogError = 2	// the conversion fails
+};
+
+// filters for scaling a bigger icon down to a missing size
+enum {
+	kExe2ICNSFilterBox = 0,	// area average; exact halving of 256 x 256 as before
+	kExe2ICNSFilterTriangle = 1,
+	kExe2ICNSFilterLanczos3 = 2	// sharpest
+};
+
+// how the png elements are compressed
+enum {
+	kExe2ICNSCompressDefault = 0,	// adaptive row filters, zlib level 9
+	kExe2ICNSCompressSmallest = 1,	// try several filter and zlib settings on the worker threads and keep the smallest
+	kExe2ICNSCompressFast = 2	// zlib level 2, for converting on demand
+};
+
+// which chunk crcs of a png icon are checked when it's decoded; a mismatch is only logged
+enum {
+	kExe2ICNSCRCAll = 0,	// every chunk that's read
+	kExe2ICNSCRCSampled = 1,	// all but the IDATs after the first (inflate still checks the adler32 of the pixel data)
+	kExe2ICNSCRCNone = 2	// for trusted input
+};
+
+// alloc and resize return NULL when out of memory; resize(ctx, NULL, size) must work like alloc
+struct Exe2ICNSAllocator_ {
+	void * (*alloc)(void *ctx, size_t size);
+	void * (*resize)(void *ctx, void *p, size_t size);
+	void (*free)(void *ctx, void *p);
+	void *ctx;
+};
+typedef struct Exe2ICNSAllocator_ Exe2ICNSAllocator;
+
+// message has no trailing newline
+typedef void (*Exe2ICNSLogFunc)(void *ctx, int level, const char *message);
+
+struct Exe2ICNSContext_ {
+	Exe2ICNSAllocator allocator;	// for the icns bytes and the decoded images
+	Exe2ICNSLogFunc log;	// NULL to keep quiet
+	void *logctx;
+	int synthesize;	// fill in the missing sizes (16, 32, 48, 128, 256) by scaling down the next bigger icon
+	int filter;	// for the synthesized sizes
+	int compression;	// for the png elements; the encoders other than zlib always do the default
+	int pngcrc;	// for png icons that are decoded
+	int retina;	// also write icons stored as png into the @2x elements of the same size (ic11, ic13, ic14)
+	int nthreads;	// threads for the icon sizes of one executable
+	int inputmode;	// for Exe2ICNSConvertFile
+};
+typedef struct Exe2ICNSContext_ Exe2ICNSContext;
+
+// what an element of the icns was made from
+enum {
+	kExe2ICNSElementMask = 1,	// 8-bit mask of the element before it
+	kExe2ICNSElementPNG = 2,
+	kExe2ICNSElementPassedThrough = 4,	// png copied from the executable as it is
+	kExe2ICNSElementSynthesized = 8	// scaled down from a bigger icon
+};
+
+struct Exe2ICNSElement_ {
+	uint32_t tag;	// e.g. 'il32'
+	long offset;	// of the element header in the icns
+	long size;	// header included
+	int width;
+	int height;
+	int sourcebpp;	// of the icon resource; 0 for synthesized ones
+	int flags;
+};
+typedef struct Exe2ICNSElement_ Exe2ICNSElement;
+
+enum {
+	kExe2ICNSMaxElements = 32
+};
+
+struct Exe2ICNSOutput_ {
+	uint8_t *data;	// from the context allocator; NULL for Exe2ICNSConvertFile
+	long size;
+	Exe2ICNSElement elements[kExe2ICNSMaxElements];
+	int nelements;
+	long bytesread;	// of the executable
+};
+typedef struct Exe2ICNSOutput_ Exe2ICNSOutput;
+
+// malloc, stderr, synthesis with the box filter, default compression, all png crcs checked, no @2x elements, 1 thread, mmap
+EXE2ICNS_API void Exe2ICNSInitContext(Exe2ICNSContext *ctx);
+
+// bump allocator for converting many files: give each thread its own arena, put it in the context
+// with Exe2ICNSArenaGetAllocator, and reset it after every file once its output isn't needed any more
+// the scratch memory of one conversion stays within a few MB; what doesn't fit goes to malloc
+typedef struct Exe2ICNSArena_ Exe2ICNSArena;
+
+EXE2ICNS_API Exe2ICNSArena * Exe2ICNSArenaCreate(size_t size);
+EXE2ICNS_API void Exe2ICNSArenaDestroy(Exe2ICNSArena *arena);
+EXE2ICNS_API void Exe2ICNSArenaReset(Exe2ICNSArena *arena);
+EXE2ICNS_API void Exe2ICNSArenaGetAllocator(Exe2ICNSArena *arena, Exe2ICNSAllocator *allocator);
+// most bytes asked of the arena between two resets
+EXE2ICNS_API size_t Exe2ICNSArenaPeakUsage(const Exe2ICNSArena *arena);
+
+// convert an executable held in memory; out->data is to be released with Exe2ICNSFreeOutput
+EXE2ICNS_API int Exe2ICNSConvert(const Exe2ICNSContext *ctx, const void *exe, long exesize, Exe2ICNSOutput *out);
+// convert ifp and write the icns to ofp as it's made; out may be NULL
+EXE2ICNS_API int Exe2ICNSConvertFile(const Exe2ICNSContext *ctx, FILE *ifp, FILE *ofp, Exe2ICNSOutput *out);
+// also empties elements; a failed conversion leaves none
+EXE2ICNS_API void Exe2ICNSFreeOutput(const Exe2ICNSContext *ctx, Exe2ICNSOutput *out);
+
+EXE2ICNS_API const char * Exe2ICNSResultString(int result);
+
+#endif
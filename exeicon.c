@@ -1,776 +1,225 @@
 /*
-	exe2icns [-f|-n] [-o output.icns] exefile.exe 
+	exe2icns [-f|-n] [-r] [-s filter] [-c compression] [-k crc] [-i mode] [-o output.icns] exefile.exe 
+	exe2icns [-f|-n] [-r] [-s filter] [-c compression] [-k crc] [-i mode] [-j threads] [-d outdir] [-l list.txt] [-0] exefile.exe ...
 */
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
-#include <math.h>
 #include <ctype.h>
 #include <unistd.h>
-#include "icnsbuilder.h"
-#include "png.h"
-
-#define DO_GAMMA_CORRECTION	1
-
-enum {
-	kSuccess = 0,
-	kInvalidFile = 101,
-	kExeHasNoIcon = 102,
-};
-
-enum {
-	kIconResourceType = 3,
-	kIconGroupResourceType = 14,
-};
+#include <errno.h>
+#include <sys/stat.h>
+#include "exe2icns.h"
+#include "taskpool.h"
 
 enum {
-	kLCIDJapanese = 1041,
+	kSuccess = kExe2ICNSSuccess,
+	kInvalidFile = kExe2ICNSInvalidFile,
+	kExeHasNoIcon = kExe2ICNSNoIcon,
+	kWriteError = kExe2ICNSWriteError,	// the output was created but couldn't be written in full
+	kOutputExists = 104,	// batch mode skips existing files unless -f
+	kOutOfMemory = kExe2ICNSOutOfMemory,
+	kCantOpenFile = 106,	// input can't be opened or output can't be created
 };
 
 typedef signed char bool;
 
 struct Parameters_ {
-	char *infilename;
+	char **infilenames;
+	long ninfiles;
 	char *outfilename;
-	bool synth128;
+	char *outdir;
+	char *listfilename;
+	bool nulseparated;
+	bool batch;
+	bool synthesize;
+	int filter;
+	int compression;
+	int pngcrc;
+	bool retina;
 	bool forceoverwrite;
+	int inputmode;
+	int nthreads;	// worker threads: one file each in batch mode, one icon size each otherwise
 };
 typedef struct Parameters_ Parameters;
 
-// exe file field accessors
-// we can assume mem to be aligned
-static uint16_t Get16(const void *mem, long off)
-{
-	const uint8_t *p = mem;
-	p += off;
-	return p[0] + 256 * p[1];
-}
-static uint32_t Get32(const void *mem, long off)
-{
-	const uint8_t *p = mem;
-	p += off;
-	return p[0] + 256 * p[1] + 65536 * p[2] + 16777216 * p[3];
-}
-
-void * LoadFile(FILE *fp, long *outlenp)
-{
-	const long kChunkSize = 16384;
-	char *buf = NULL;
-	char *p;
-	long datalen = 0;
-	long bufsize = kChunkSize;
-	long c;
-	do {
-		p = realloc(buf, bufsize + kChunkSize);
-		if (p == NULL)
-			break;
-		buf = p;
-		bufsize += kChunkSize;
-		c = fread(&buf[datalen], 1, bufsize - datalen, fp);
-		if (c <= 0)
-			break;
-		datalen += c;
-	} while (1);
-	if (outlenp)
-		*outlenp = datalen;
-	return buf;
-}
-
-static const char * TagName(uint32_t tag)
-{
-	static char s[5];
-	s[0] = tag >> 24;
-	s[1] = tag >> 16;
-	s[2] = tag >> 8;
-	s[3] = tag;
-	s[4] = 0;
-	return s;
-}
-
-/*
-	https://docs.microsoft.com/en-us/windows/win32/debug/pe-format
-	https://docs.microsoft.com/en-us/previous-versions/ms809762(v=msdn.10)#pe-file-resources
-*/
-
-/*
-	Windows Resource Structure
-	
-	Root dir -> Type dir -> Name dir -> Language dir
-	e.g.
-	Root -> Icon Group (14) -> 101 -> Japanese (1041)
-	
-	Resource Directory Table:
-	0/4	reserved
-	4/4	timestamp
-	8/2+2	major/minor version
-	12/2	# of named entries (1)
-	14/2	# of ID entries (2)
-	[followed by (1) + (2) resource directory entries]
-	
-	Resource Directory Entry:
-	0/4	name offset/ID
-	4/4	data entry offset (high bit 0)/subdirectory offset (high bit 1)
-	
-	Resource Directory String:
-	0/2	length
-	2/x	unicode characters
-	
-	Resource Data Entry
-	0/4	payload addr (addr when .rsrc is loaded into the virtual address)
-	4/4	payload size
-	8/4	codepage of resource
-	12/4	reserved
-*/
-
-long ResourceFindIDEntry(const void *rsrcData, long diroffset, int rsrcid)
-{
-	const char *p = rsrcData;
-	int namedcount, idcount;
-	int i;
-	const long kTableSize = 16;
-	const long kEntrySize = 8;
-	p += diroffset;
-	namedcount = Get16(p, 12);
-	idcount = Get16(p, 14);
-	p += kTableSize + kEntrySize * namedcount;
-	for (i = 0; i < idcount; i++) {
-		uint32_t entryid = Get32(p, 0);
-		if (entryid & 0x80000000)	// this is a named resource
-			;
-		else if (entryid == rsrcid) {
-			// found
-			return Get32(p, 4);
-			break;
-		}
-		p += kEntrySize;
-	}
-	return 0;	// address 0 is regarded invalid
-}
-
-
-// index is 0-based
-long ResourceFindIndEntry(const void *rsrcData, long diroffset, int index)
-{
-	const char *p = rsrcData;
-	int namedcount, idcount;
-	const long kTableSize = 16;
-	const long kEntrySize = 8;
-	p += diroffset;
-	namedcount = Get16(p, 12);
-	idcount = Get16(p, 14);
-	if (index < namedcount + idcount) {
-		return Get32(p, kTableSize + kEntrySize * index + 4);
-	}
-	return 0;	// address 0 is regarded invalid
-}
-
-/*
-	Icon Group Resource
-	
-	https://devblogs.microsoft.com/oldnewthing/20120720-00/?p=7083
-	
-	GRPICONDIR:
-	0/2	reserved
-	2/2	type (1 = icon)
-	4/2	# of icons (n)
-	6/x	n * GRPICONDIRENTRY
-	
-	GRPICONDIRENTRY:
-	0/1	width
-	1/1	height
-	2/1	# of colours (0 if 256 colours or more)
-	3/1	reserved
-	4/2	# of planes (must be 1)
-	6/2	bit count
-	8/4	data size
-	12/2	id
-*/
-
-long FindIcon(const void *rsrcData, int id, int langcode, long *outaddr, long *outsize)
-{
-	const char *p = rsrcData;
-	long icondir;
-	long theicon;
-	long icondata;
-	long iconoff, iconsize;
-	
-	icondir = ResourceFindIDEntry(p, 0, kIconResourceType);
-	if (icondir == 0) {
-		// no icon
-		return 0;
-	}
-	icondir &= 0x7FFFFFFF;	// assuming another directory
-	
-	theicon = ResourceFindIDEntry(p, icondir, id);
-	if (theicon == 0) {
-		// can't find icon
-		return 0;
-	}
-	theicon &= 0x7FFFFFFF;		// assuming once again
-	
-	icondata = ResourceFindIDEntry(p, theicon, langcode);
-	if (icondata == 0)
-		icondata = ResourceFindIndEntry(p, theicon, 0);
-	if (icondata == 0) {
-		// can't find icon
-		return 0;
-	}
-	
-	iconoff = Get32(p, icondata + 0);
-	iconsize = Get32(p, icondata + 4);
-	
-	if (outaddr)
-		*outaddr = iconoff;
-	if (outsize)
-		*outsize = iconsize;
-	
-	return icondata;
-}
-
-long FindIndIconGroup(const void *rsrcData, int idx, int langcode, long *outaddr, long *outsize)
-{
-	const char *p = rsrcData;
-	long icongroupdir;
-	long thegroup;
-	long groupdata;
-	long groupoff, groupsize;
-	
-	icongroupdir = ResourceFindIDEntry(p, 0, kIconGroupResourceType);
-	if (icongroupdir == 0) {
-		// no icon
-		return 0;
-	}
-	icongroupdir &= 0x7FFFFFFF;	// assuming another directory
-	
-	thegroup = ResourceFindIndEntry(p, icongroupdir, idx);
-	if (thegroup == 0) {
-		// can't find icon group
-		return 0;
-	}
-	thegroup &= 0x7FFFFFFF;		// assuming once again
-	
-	groupdata = ResourceFindIDEntry(p, thegroup, langcode);
-	if (groupdata == 0)
-		groupdata = ResourceFindIndEntry(p, thegroup, 0);
-	if (groupdata == 0) {
-		// can't find icon group
-		return 0;
-	}
-	
-	groupoff = Get32(p, groupdata + 0);
-	groupsize = Get32(p, groupdata + 4);
-	
-	if (outaddr)
-		*outaddr = groupoff;
-	if (outsize)
-		*outsize = groupsize;
-	
-	return groupdata;
-}
-
-bool IsPNGTag(uint32_t tag)
-{
-	return tag == 'ic08'	// 256x256
-		|| tag == 'ic07'	// 128x256
-		;
-}
-
-double GammaCorrectedAverage(double ingamma, double outgamma, int n, ...)
-{
-	int i;
-	va_list ap;
-	double sum = 0;
-	double outrgamma = 1.0 / outgamma;
-	
-	va_start(ap, n);
-	for (i = 0; i < n; i++) {
-		double v = va_arg(ap, double);
-		sum += pow(v, ingamma);
-	}
-	sum /= n;
-	va_end(ap);
-	return pow(sum, outrgamma);
-}
-
-void * ExtractMainIconAsICNSFromResource(const void *rsrcData, long rsrclen, long virtualaddr, bool synth128, long *outicnssize)
-{
-	const uint8_t *p = rsrcData;
-	int langcode = kLCIDJapanese;
-	long groupdata;	// offset to icon group resource data entry
-	long groupoff;	// offset to the actual payload
-	long groupsize;	// size of the payload
-	void *icnsdata = NULL;
-	
-	groupdata = FindIndIconGroup(rsrcData, 0, langcode, &groupoff, &groupsize);
-	
-	if (groupdata == 0) {
-		return NULL;
-	}
-	
-	groupoff -= virtualaddr;
-	
-	// icon group found
-	// parse icon group resource
-	{
-		const uint8_t *q = p + groupoff;
-		int count = Get16(q, 4);
-		int i;
-		bool done256 = 0, done128 = 0, done48 = 0, done32 = 0, done16 = 0, done12 = 0;
-		uint8_t *rgb256 = malloc(256 * 256 * 4);
-		uint8_t *mask256 = malloc(256 * 256);
-		int bpp256 = 0;
-		ICNSBuilder builder;
-		
-		ICNSBuilderInit(&builder);
-		q += 6;
-		for (i = 0; i < count; i++) {
-			int id = Get16(q, 12);
-			int width = q[0] == 0 ? 256 : (uint8_t)q[0];
-			int height = q[1] == 0 ? 256 : (uint8_t)q[1];
-			int bpp = Get16(q, 6);
-			long iconoff;
-			long iconsize;
-			long icondata;
-			uint32_t tag = 0;
-			uint32_t masktag = 0;
-			
-			// the largest icon size we can get here is 256 x 256
-			if (width == 256 && height == 256 && bpp >= 8) {
-				if (! done256) {
-					tag = 'ic08';
-					done256 = 1;
-				}
-			}
-			else if (width == 128 && height == 128 && bpp >= 8) {
-				if (! done128) {
-					tag = 'it32';
-					masktag = 't8mk';
-					done128 = 1;
-				}
-			}
-			else if (width == 48 && height == 48 && bpp >= 8) {
-				if (! done48) {
-					tag = 'ih32';
-					masktag = 'h8mk';
-					done48 = 1;
-				}
-			}
-			else if (width == 32 && height == 32 && bpp >= 8) {
-				if (! done32) {
-					tag = 'il32';
-					masktag = 'l8mk';
-					done32 = 1;
-				}
-			}
-			else if (width == 16 && height == 16 && bpp >= 8) {
-				if (! done16) {
-					tag = 'is32';
-					masktag = 's8mk';
-					done16 = 1;
-				}
-			}
-			//else if (width == 16 && height == 12) {
-			//	tag = 'icm8';
-			//}
-			
-			if (tag != 0) {
-				fprintf(stderr, "processing icon: %d x %d, %d bit(s) > '%s'\n", width, height, bpp, TagName(tag));
-				icondata = FindIcon(rsrcData, id, langcode, &iconoff, &iconsize);
-				if (icondata) {
-					bool ispng = 0;
-					uint8_t *pngrgba = NULL;
-					uint8_t *rgb = NULL;
-					uint8_t *mask = NULL;
-					uint8_t *png = NULL;
-					long pngsize;
-					iconoff -= virtualaddr;
-					fprintf(stderr, "icon data at %08lX, length %08lX\n", iconoff, iconsize);
-					// do extraction
-					if (memcmp(p + iconoff, "\x89PNG", 4) == 0) {
-						ispng = 1;
-						if (IsPNGTag(tag)) {
-							png = malloc(iconsize);
-							memmove(png, p + iconoff, iconsize);
-							pngsize = iconsize;
-						}
-						else {
-							int i, j;
-							long pngwid, pnghei;
-							pngrgba = ExpandPNG(p + iconoff, iconsize, &pngwid, &pnghei);
-							rgb = malloc(4 * width * height);
-							mask = malloc(width * height);
-							for (i = 0; i < height; i++) {
-								for (j = 0; j < width; j++) {
-									rgb[4*(i*width + j) + 0] = 0;
-									rgb[4*(i*width+j)+1] = pngrgba[4*(i*width+j)+1];
-									rgb[4*(i*width+j)+2] = pngrgba[4*(i*width+j)+2];
-									rgb[4*(i*width+j)+3] = pngrgba[4*(i*width+j)+3];
-									mask[i*width+j] = pngrgba[4*(i*width+j)+0];
-								}
-							}
-						}
-					}
-					else {
-						long infosize = Get32(p, iconoff + 0);
-						width = Get32(p, iconoff + 4);
-						height = Get32(p, iconoff + 8) / 2;	// icon dib height must be divided by 2
-						bpp = Get16(p, iconoff + 14);
-						// 
-						if (bpp == 32 || bpp == 24) {
-							int i, j;
-							const uint8_t *dib = p + iconoff + infosize;
-							rgb = malloc(4 * width * height);
-							mask = malloc(1 * width * height);
-							for (i = 0; i < height; i++) {
-								for (j = 0; j < width; j++) {
-									// DIB image holds components in BGRA order, bottom to top
-									rgb[4*(i*width + j) + 0] = 0;
-									rgb[4*(i*width + j) + 1] = dib[4*((height-i-1)*width + j) + 2];
-									rgb[4*(i*width + j) + 2] = dib[4*((height-i-1)*width + j) + 1];
-									rgb[4*(i*width + j) + 3] = dib[4*((height-i-1)*width + j) + 0];
-									mask[i*width + j] = dib[4*((height-i-1)*width + j) + 3];
-								}
-							}
-							if (infosize + 4 * width * height < iconsize) {
-								// has mask data?
-								fprintf(stderr, "this icon seems to have a mask (%ld bytes), which is unsupported by this program\n", iconsize - infosize - 4 * width * height);
-							}
-						}
-						else if (bpp == 8) {
-							int i, j;
-							int dibrow = ((width + 3) / 4) * 4;		// align to 32-bit boundary
-							int maskrow = ((width + 31) / 32) * 4;
-							const uint8_t *palette = p + iconoff + infosize;
-							const uint8_t *dib = palette + 256 * 4;
-							const uint8_t *dibmask = dib + width * height;
-							rgb = malloc(4 * width * height);
-							mask = malloc(1 * width * height);
-							for (i = 0; i < height; i++) {
-								for (j = 0; j < width; j++) {
-									uint8_t idx = dib[(height-i-1)*dibrow + j];
-									uint8_t maskbit;
-									rgb[4*(i*width + j) + 0] = 0;
-									rgb[4*(i*width + j) + 1] = palette[4*idx + 2];
-									rgb[4*(i*width + j) + 2] = palette[4*idx + 1];
-									rgb[4*(i*width + j) + 3] = palette[4*idx + 0];
-									maskbit = (dibmask[(height-i-1)*maskrow + j/8] >> 7-j%8) & 1;
-									mask[i*width + j] = maskbit ? 0 : 255;
-								}
-							}
-						}
-						else if (bpp == 4) {
-							int i, j;
-							int dibrow = ((width + 7) / 8) * 4;		// align to 32-bit boundary
-							int maskrow = ((width + 31) / 32) * 4;
-							const uint8_t *palette = p + iconoff + infosize;
-							const uint8_t *dib = palette + 16 * 4;
-							const uint8_t *dibmask = dib + width * height;
-							rgb = malloc(4 * width * height);
-							mask = malloc(1 * width * height);
-							for (i = 0; i < height; i++) {
-								for (j = 0; j < width; j++) {
-									uint8_t idx = (dib[(height-i-1)*dibrow + j/2] >> ((j & 1) ? 4 : 0)) & 15;
-									uint8_t maskbit;
-									rgb[4*(i*width + j) + 0] = 0;
-									rgb[4*(i*width + j) + 1] = palette[4*idx + 2];
-									rgb[4*(i*width + j) + 2] = palette[4*idx + 1];
-									rgb[4*(i*width + j) + 3] = palette[4*idx + 0];
-									maskbit = (dibmask[(height-i-1)*maskrow + j/8] >> 7-j%8) & 1;
-									mask[i*width + j] = maskbit ? 0 : 255;
-								}
-							}
-						}
-						
-					}
-					if (IsPNGTag(tag)) {
-						if (png)
-							fprintf(stderr, "passing through the png data for %s\n", TagName(tag));
-						if (png == NULL)
-							png = CompressToPNG(width, height, rgb, mask, &pngsize);
-						ICNSAddData(&builder, tag, png, pngsize);
-					}
-					else {
-						uint8_t *compressed = malloc(4 * width * height * 2);
-						long compsize = ICNSCompressImage(tag, rgb, 4 * width * height, compressed);
-						//ICNSAddData(&builder, tag, rgb, 4 * width * height);
-						ICNSAddData(&builder, tag, compressed, compsize);
-						ICNSAddData(&builder, masktag, mask, width * height);
-						free(compressed);
-					}
-					
-					if (width == 256 && height == 256) {
-						if (bpp > bpp256) {
-							memmove(rgb256, rgb, 256 * 256 * 4);
-							memmove(mask256, mask, 256 * 256);
-						}
-					}
-					
-					free(pngrgba);	// freeing NULL is ok
-					free(png);
-					free(rgb);
-					free(mask);
-				}
-			}
-			else {
-				fprintf(stderr, "skipping icon: %d x %d, %d bit(s)\n", width, height, bpp);
-			}
-			q += 14;
-		}
-		
-		if (done256 && ! done128 && synth128) {
-			// synthesize osx-standard 128x128 pixel icon
-			int i, j;
-			uint8_t *rgb = malloc(128 * 128 * 4);
-			uint8_t *mask = malloc(128 * 128);
-			uint8_t *compressed = malloc(128 * 128 * 4 * 2);
-			long compsize;
-			fprintf(stderr, "synthesizing 128 x 128 icon [it32/t8mk]...\n");
-			for (i = 0; i < 128; i++) {
-				for (j = 0; j < 128; j++) {
-					uint8_t r1 = rgb256[((i*2)*256+(j*2))*4 + 1];
-					uint8_t g1 = rgb256[((i*2)*256+(j*2))*4 + 2];
-					uint8_t b1 = rgb256[((i*2)*256+(j*2))*4 + 3];
-					uint8_t r2 = rgb256[((i*2)*256+(j*2+1))*4 + 1];
-					uint8_t g2 = rgb256[((i*2)*256+(j*2+1))*4 + 2];
-					uint8_t b2 = rgb256[((i*2)*256+(j*2+1))*4 + 3];
-					uint8_t r3 = rgb256[((i*2+1)*256+(j*2))*4 + 1];
-					uint8_t g3 = rgb256[((i*2+1)*256+(j*2))*4 + 2];
-					uint8_t b3 = rgb256[((i*2+1)*256+(j*2))*4 + 3];
-					uint8_t r4 = rgb256[((i*2+1)*256+(j*2+1))*4 + 1];
-					uint8_t g4 = rgb256[((i*2+1)*256+(j*2+1))*4 + 2];
-					uint8_t b4 = rgb256[((i*2+1)*256+(j*2+1))*4 + 3];
-					rgb[(i*128+j)*4] = 255;
-#if DO_GAMMA_CORRECTION
-					// outgamma should actually be 1.8, but other images aren't doing gamma correction
-					rgb[(i*128+j)*4+1] = (255 * GammaCorrectedAverage(2.2, 2.2, 4, r1/255.0, r2/255.0, r3/255.0, r4/255.0) + 0.5);
-					rgb[(i*128+j)*4+2] = (255 * GammaCorrectedAverage(2.2, 2.2, 4, g1/255.0, g2/255.0, g3/255.0, g4/255.0) + 0.5);
-					rgb[(i*128+j)*4+3] = (255 * GammaCorrectedAverage(2.2, 2.2, 4, b1/255.0, b2/255.0, b3/255.0, b4/255.0) + 0.5);
-#else
-					rgb[(i*128+j)*4+1] = (r1 + r2 + r3 + r4 + 2) / 4;
-					rgb[(i*128+j)*4+2] = (g1 + g2 + g3 + g4 + 2) / 4;
-					rgb[(i*128+j)*4+3] = (b1 + b2 + b3 + b4 + 2) / 4;
-#endif
-				}
-			}
-			for (i = 0; i < 128; i++) {
-				for (j = 0; j < 128; j++) {
-					uint8_t m1 = mask256[(i*2)*256+(j*2)];
-					uint8_t m2 = mask256[(i*2)*256+(j*2+1)];
-					uint8_t m3 = mask256[(i*2+1)*256+(j*2)];
-					uint8_t m4 = mask256[(i*2+1)*256+(j*2+1)];
-					// no mask gamma
-					mask[i*128+j] = (m1 + m2 + m3 + m4 + 2) / 4;
-				}
-			}
-			compsize = ICNSCompressImage('it32', rgb, 4 * 128 * 128, compressed);
-			ICNSAddData(&builder, 'it32', compressed, compsize);
-			//ICNSAddData(&builder, 'it32', rgb, 128 * 128 * 4);
-			ICNSAddData(&builder, 't8mk', mask, 128 * 128);
-#if 0
-			{
-				FILE *fp = fopen("test.tiff", "wb");
-				long l;
-				unsigned char tiffhdr[] = {
-					'M', 'M', 0, 42, 
-					0, 0, 0, 8,
-					0, 13,
-					// 10
-					1, 0,	// ImageWidth
-					0, 3, 0, 0, 0, 1, 0, 128, 0, 0,
-					1, 1,	// ImageLength
-					0, 3, 0, 0, 0, 1, 0, 128, 0, 0,
-					1, 2,	// BitsPerSample
-					0, 3, 0, 0, 0, 4, 0, 0, 0, 170,
-					1, 3,	// Compression
-					0, 3, 0, 0, 0, 1, 0, 1, 0, 0,
-					1, 6,	// PhotometricInterpretation
-					0, 3, 0, 0, 0, 1, 0, 2, 0, 0,
-					1, 17,	// StripOffsets
-					0, 4, 0, 0, 0, 1, 0, 0, 0, 194,
-					1, 21,	// SamplesPerPixel
-					0, 3, 0, 0, 0, 1, 0, 4, 0, 0,
-					1, 22,	// RowsPerStrip
-					0, 3, 0, 0, 0, 1, 0, 128, 0, 0,
-					1, 23,	// StripByteCounts
-					0, 4, 0, 0, 0, 1, 0, 1, 0, 0,
-					1, 26,	// XResolution
-					0, 5, 0, 0, 0, 1, 0, 0, 0, 178,
-					1, 27,	// YResolution
-					0, 5, 0, 0, 0, 1, 0, 0, 0, 186,
-					1, 40,	// ResolutionUnit
-					0, 3, 0, 0, 0, 1, 0, 2, 0, 0,
-					1, 82,	// ExtraSamples
-					0, 3, 0, 0, 0, 1, 0, 2, 0, 0,
-					// 166
-					0, 0, 0, 0,
-					// 170
-					0, 8, 0, 8, 0, 8, 0, 8,
-					// 178
-					0, 0, 0, 72, 0, 0, 0, 1,
-					// 186
-					0, 0, 0, 72, 0, 0, 0, 1,
-					// 194
-				};
-				//if (fp) for (l = 0; l < 128 * 128; l++) fputc(rgb[l*4+1], fp);
-				fwrite(tiffhdr, 1, sizeof(tiffhdr), fp);
-				for (l = 0; l < 128 * 128; l++) {
-					rgb[l*4] = rgb[l*4+1];
-					rgb[l*4+1] = rgb[l*4+2];
-					rgb[l*4+2] = rgb[l*4+3];
-					rgb[l*4+3] = mask[l];
-				}
-				fwrite(rgb, 1, 128 * 128 * 4, fp);
-				fclose(fp);
-			}
-#endif
-			free(rgb);
-			free(mask);
-			free(compressed);
-		}
-		
-		if (1) {
-			uint8_t *p = ICNSBuilderGetDataPtr(&builder);
-			long size = ICNSBuilderGetSize(&builder);
-			if (size > 0) {
-				icnsdata = malloc(size);
-				memmove(icnsdata, p, size);
-				if (outicnssize)
-					*outicnssize = size;
-			}
-		}
-		ICNSBuilderTerminate(&builder);
-		free(rgb256);
-		free(mask256);
-	}
-	return icnsdata;
-}
+// growable list of input file names
+struct FileList_ {
+	char **names;
+	long count;
+	long capacity;
+};
+typedef struct FileList_ FileList;
 
+enum {
+	kArenaSize = 4 * 1024 * 1024	// plenty for the scratch memory of one 256 x 256 icon set
+};
 
-int DoFile(FILE *ifp, FILE *ofp)
+// arena is NULL for plain malloc; it's reset when the file is done
+int DoFile(FILE *ifp, FILE *ofp, const Parameters *pp, Exe2ICNSArena *arena)
 {
-	long exesize;
-	char *exe = LoadFile(ifp, &exesize);
-	int result = 0;
-	long pos;
-	long peoff;
-	int nsecs;
-	int opthdrsize;
-	int optmagic;
-	long alignment;
-	long sectableoff;
-	int i;
-	char *rsrcdata;
-	long rsrcsize;
-	long rawoff = 0;
-	long rawsize = 0;
-	long virtualaddr = 0;
-	void *icnsdata = NULL;
-	long icnssize;
-	
-	if (Get16(exe, 0) != 0x5A4D) {	// 'MZ'
-		result = kInvalidFile;
-		fprintf(stderr, "no MZ signature\n");
-		goto FreeExit;
-	}
-	peoff = Get32(exe, 60);
-	if (Get32(exe, peoff) != 0x00004550) {	// 'PE\0\0'
-		result = kInvalidFile;
-		fprintf(stderr, "no PE signature at %lX\n", peoff);
-		goto FreeExit;
-	}
-	
-	nsecs = Get16(exe, peoff + 4 + 2);
-	opthdrsize = Get16(exe, peoff + 4 + 16);
-	optmagic = Get16(exe, peoff + 4 + 20);
-	if (optmagic == 0x20B) {
-		// 64-bit optional header
-		alignment = Get32(exe, peoff + 4 + 20 + 36);
-	}
-	else /*if (optmagic == 0x10B)*/ {
-		// 32-bit optional header
-		// actually there's not much difference
-		alignment = Get32(exe, peoff + 4 + 20 + 36);
-	}
-	sectableoff = peoff + 4 + 20 + opthdrsize;
+	Exe2ICNSContext ctx;
+	int r;
 	
-	// find .rsrc section
-	for (i = 0; i < nsecs; i++) {
-		const int sechdrsize = 40;
-		long sechdroff = sectableoff + i * sechdrsize;
-		const char *sechdr = exe + sechdroff;
-		fprintf(stderr, "[%.8s section header at %08lX]\n", sechdr, sechdroff);
-		if (strcmp(sechdr, ".rsrc") == 0) {
-			// found
-			virtualaddr = Get32(sechdr, 12);
-			rawoff = Get32(sechdr, 20);
-			rawsize = Get32(sechdr, 16);
-			fprintf(stderr, "[.rsrc offset %08lX / size %08lX / virtualaddr %08lX]\n", rawoff, rawsize, virtualaddr);
-			/*{
-				FILE *fp = fopen("test.rsrc", "wb");
-				if (fp)
-					fwrite(exe + rawoff, 1, rawsize, fp);
-				fclose(fp);
-			}*/
-			icnsdata = ExtractMainIconAsICNSFromResource(exe + rawoff, rawsize, virtualaddr, 1, &icnssize);
-			break;
-		}
-	}
-	
-	if (icnsdata) {
-		fwrite(icnsdata, 1, icnssize, ofp);
-		free(icnsdata);
-	}
-	else {
-		fprintf(stderr, "no icon data in executable\n");
-		result = kExeHasNoIcon;
-	}
-	
-FreeExit:
-	free(exe);
-	return result;
+	Exe2ICNSInitContext(&ctx);
+	if (arena)
+		Exe2ICNSArenaGetAllocator(arena, &ctx.allocator);
+	ctx.synthesize = pp->synthesize;
+	ctx.filter = pp->filter;
+	ctx.compression = pp->compression;
+	ctx.pngcrc = pp->pngcrc;
+	ctx.retina = pp->retina;
+	ctx.nthreads = pp->batch ? 1 : pp->nthreads;
+	ctx.inputmode = pp->inputmode;
+	r = Exe2ICNSConvertFile(&ctx, ifp, ofp, NULL);
+	if (arena)
+		Exe2ICNSArenaReset(arena);
+	return r;
 }
 
 void Usage(FILE *fp)
 {
-	fputs("usage: exe2icns [-f|-n] [-o outicon.icns] exefile.exe\n", fp);
+	fputs("usage: exe2icns [-f|-n] [-r] [-s filter] [-c compression] [-k crc] [-i mode] [-o outicon.icns] exefile.exe\n", fp);
+	fputs("usage: exe2icns [-f|-n] [-r] [-s filter] [-c compression] [-k crc] [-i mode] [-j threads] [-d outdir] [-l list.txt] [-0] exefile.exe ...\n", fp);
 	fputs("usage: exe2icns -h\n", fp);
 }
 
 void Help(FILE *fp)
 {
 	Usage(fp);
+	fputs("  -0              # read NUL-separated input file names from stdin\n", fp);
+	fputs("  -c <mode>       # how hard to compress the png icons: default, smallest or fast\n", fp);
+	fputs("                  # smallest tries several settings on the -j threads\n", fp);
+	fputs("                  # and keeps the smallest; fast is for on-demand conversion\n", fp);
+	fputs("                  # (both only with the zlib png encoder)\n", fp);
+	fputs("  -d <dir>        # write the icons into <dir> (default: next to each exefile)\n", fp);
 	fputs("  -f              # force overwriting the output file\n", fp);
 	fputs("  -h              # show this help\n", fp);
-	fputs("  -n              # suppress auto-synthesis of 128 x 128 icon\n", fp);
-	fputs("                  # from 256 x 256 icon\n", fp);
+	fputs("  -i <mode>       # how to read the input: mmap (default), read or pread\n", fp);
+	fputs("                  # pread fetches only the headers and the icon data\n", fp);
+	fputs("                  # mmap and pread fall back to read for pipes and stdin\n", fp);
+	fputs("  -j <threads>    # convert files on <threads> threads in batch mode,\n", fp);
+	fputs("                  # or the icon sizes of a single file in parallel\n", fp);
+	fputs("                  # (default: 1, 0 = one per processor)\n", fp);
+	fputs("  -k <crc>        # which chunk crcs of png icons to check: all (default), sampled\n", fp);
+	fputs("                  # (all but the IDATs after the first) or none\n", fp);
+	fputs("  -l <list.txt>   # read input file names from <list.txt>, one per line\n", fp);
+	fputs("  -n              # suppress auto-synthesis of the missing 16, 32, 48, 128\n", fp);
+	fputs("                  # and 256 x 256 icons from bigger ones\n", fp);
 	fputs("  -o <icon.icns>  # specify the output file name (default: <exefile>.icns)\n", fp);
+	fputs("                  # required when exefile is - (stdin)\n", fp);
+	fputs("  -r              # also copy png icons into the @2x (retina) elements\n", fp);
+	fputs("                  # of the same size (ic11, ic13, ic14)\n", fp);
+	fputs("  -s <filter>     # filter for the synthesized icons: box (default), triangle\n", fp);
+	fputs("                  # or lanczos3\n", fp);
+	fputs("batch mode (several exefiles, -d, -l or -0) never asks before overwriting;\n", fp);
+	fputs("existing icons are skipped unless -f is given.\n", fp);
 }
 
 bool ParseArgs(int argc, char *argv[], Parameters *pp)
 {
 	// set default params
-	pp->synth128 = 1;
+	pp->synthesize = 1;
+	pp->filter = kExe2ICNSFilterBox;
+	pp->compression = kExe2ICNSCompressDefault;
+	pp->pngcrc = kExe2ICNSCRCAll;
+	pp->retina = 0;
 	pp->forceoverwrite = 0;
-	pp->infilename = NULL;
+	pp->infilenames = NULL;
+	pp->ninfiles = 0;
 	pp->outfilename = NULL;
+	pp->outdir = NULL;
+	pp->listfilename = NULL;
+	pp->nulseparated = 0;
+	pp->batch = 0;
+	pp->inputmode = kExe2ICNSInputMap;
+	pp->nthreads = 1;
 	// parse
 	do {
-		int op = getopt(argc, argv, "fhno:");
+		int op = getopt(argc, argv, "0c:d:fhi:j:k:l:no:rs:");
 		if (op == -1)
 			break;
 		switch (op) {
+		case '0':
+			pp->nulseparated = 1;
+			break;
+		case 'c':
+			if (strcmp(optarg, "default") == 0)
+				pp->compression = kExe2ICNSCompressDefault;
+			else if (strcmp(optarg, "smallest") == 0)
+				pp->compression = kExe2ICNSCompressSmallest;
+			else if (strcmp(optarg, "fast") == 0)
+				pp->compression = kExe2ICNSCompressFast;
+			else {
+				fprintf(stderr, "unknown compression: %s\n", optarg);
+				Usage(stderr);
+				exit(1);
+			}
+			break;
+		case 'd':
+			pp->outdir = optarg;
+			break;
 		case 'f':
 			pp->forceoverwrite = 1;
 			break;
+		case 'i':
+			if (strcmp(optarg, "mmap") == 0)
+				pp->inputmode = kExe2ICNSInputMap;
+			else if (strcmp(optarg, "read") == 0)
+				pp->inputmode = kExe2ICNSInputRead;
+			else if (strcmp(optarg, "pread") == 0)
+				pp->inputmode = kExe2ICNSInputSelective;
+			else {
+				fprintf(stderr, "unknown input mode: %s\n", optarg);
+				Usage(stderr);
+				exit(1);
+			}
+			break;
+		case 'j':
+			pp->nthreads = atoi(optarg);
+			if (pp->nthreads <= 0)
+				pp->nthreads = CountProcessors();
+			break;
+		case 'k':
+			if (strcmp(optarg, "all") == 0)
+				pp->pngcrc = kExe2ICNSCRCAll;
+			else if (strcmp(optarg, "sampled") == 0)
+				pp->pngcrc = kExe2ICNSCRCSampled;
+			else if (strcmp(optarg, "none") == 0)
+				pp->pngcrc = kExe2ICNSCRCNone;
+			else {
+				fprintf(stderr, "unknown crc check: %s\n", optarg);
+				Usage(stderr);
+				exit(1);
+			}
+			break;
+		case 'l':
+			pp->listfilename = optarg;
+			break;
 		case 'n':
-			pp->synth128 = 0;
+			pp->synthesize = 0;
 			break;
 		case 'o':
 			pp->outfilename = optarg;
 			break;
+		case 'r':
+			pp->retina = 1;
+			break;
+		case 's':
+			if (strcmp(optarg, "box") == 0)
+				pp->filter = kExe2ICNSFilterBox;
+			else if (strcmp(optarg, "triangle") == 0)
+				pp->filter = kExe2ICNSFilterTriangle;
+			else if (strcmp(optarg, "lanczos3") == 0)
+				pp->filter = kExe2ICNSFilterLanczos3;
+			else {
+				fprintf(stderr, "unknown filter: %s\n", optarg);
+				Usage(stderr);
+				exit(1);
+			}
+			break;
 		case 'h':
 			Help(stdout);
 			exit(0);
@@ -781,74 +230,289 @@ bool ParseArgs(int argc, char *argv[], Parameters *pp)
 			//break;
 		}
 	} while (1);
-	if (optind < argc) {
-		pp->infilename = argv[optind];
+	pp->infilenames = argv + optind;
+	pp->ninfiles = argc - optind;
+	pp->batch = pp->ninfiles > 1 || pp->outdir || pp->listfilename || pp->nulseparated;
+	if (pp->batch) {
+		if (pp->outfilename) {
+			fprintf(stderr, "-o can't be used with several input files; use -d\n");
+			return 0;
+		}
+		return 1;
+	}
+	if (pp->ninfiles == 1) {
+		if (strcmp(pp->infilenames[0], "-") == 0 && pp->outfilename == NULL) {
+			fprintf(stderr, "-o is required when reading from stdin\n");
+			return 0;
+		}
 		return 1;
 	}
 	else {
 		fprintf(stderr, "no input file\n");
-		Usage(stderr);
 		return 0;
 	}
 }
 
-int main(int argc, char *argv[])
+// <exefile>.icns, either next to the input or in outdir
+// free() the returned pointer by yourself
+char * MakeOutputName(const char *infilename, const char *outdir)
 {
-	Parameters pr;
+	const char *base = infilename;
+	const char *p;
+	long l;
+	long dirlen = 0;
+	char *icnsname;
+	if (outdir) {
+		p = strrchr(infilename, '/');
+		if (p)
+			base = p + 1;
+		dirlen = strlen(outdir) + 1;
+	}
+	l = strlen(base);
+	p = strrchr(base, '.');
+	if (p && strcasecmp(p, ".exe") == 0) {
+		l = p - base;
+	}
+	icnsname = malloc(dirlen + l + 5 + 1);
+	if (icnsname == NULL)
+		return NULL;
+	if (outdir) {
+		memmove(icnsname, outdir, dirlen - 1);
+		icnsname[dirlen - 1] = '/';
+	}
+	memmove(icnsname + dirlen, base, l);
+	strcpy(icnsname + dirlen + l, ".icns");
+	return icnsname;
+}
+
+// convert infilename into outfilename
+// in batch mode existing output files are skipped (or overwritten with -f)
+// a failure doesn't leave a truncated icns behind: the output is removed if it's a regular file
+int ConvertFile(const Parameters *pp, Exe2ICNSArena *arena, const char *infilename, const char *outfilename)
+{
+	FILE *fp;
+	FILE *ofp;
+	bool ov;
+	int r;
 	
-	if (ParseArgs(argc, argv, &pr)) {
-		FILE *fp = fopen(pr.infilename, "rb");
-		int r;
-		if (fp) {
-			char *icnsname = NULL;
-			FILE *ofp;
-			bool ov;
-			if (pr.outfilename == NULL) {
-				long l = strlen(pr.infilename);
-				char *p = strrchr(pr.infilename, '.');
-				icnsname = malloc(l + 5 + 1);
-				if (p && strcasecmp(p, ".exe") == 0) {
-					l = p - pr.infilename;
-				}
-				memmove(icnsname, pr.infilename, l);
-				strcpy(icnsname + l, ".icns");
-				pr.outfilename = icnsname;
+	fp = strcmp(infilename, "-") == 0 ? stdin : fopen(infilename, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s\n", infilename);
+		return kCantOpenFile;
+	}
+	// file exists?
+	if (pp->forceoverwrite)
+		ov = 1;
+	else {
+		ofp = fopen(outfilename, "rb");
+		if (ofp) {
+			int ch;
+			fclose(ofp);
+			if (pp->batch) {
+				fprintf(stderr, "%s exists; skipping\n", outfilename);
+				ov = 0;
 			}
-			// file exists?
-			if (pr.forceoverwrite)
-				ov = 1;
 			else {
-				ofp = fopen(pr.outfilename, "rb");
-				if (ofp) {
-					int ch;
-					fprintf(stderr, "overwrite %s? [y/n]\n", pr.outfilename);
-					ch = fgetc(stdin);
-					ov = tolower(ch) == 'y';
-				}
-				else
-					ov = 1;
-				fclose(ofp);
+				fprintf(stderr, "overwrite %s? [y/n]\n", outfilename);
+				ch = fgetc(stdin);
+				ov = tolower(ch) == 'y';
 			}
-			//
-			if (ov) {
-				ofp = fopen(pr.outfilename, "wb");
-				if (ofp) {
-					r = DoFile(fp, ofp);
-				}
-				else {
-					fprintf(stderr, "can't open %s for writing\n", pr.outfilename);
-					r = 1;
-				}
-				fclose(ofp);
+		}
+		else
+			ov = 1;
+	}
+	//
+	if (ov) {
+		ofp = fopen(outfilename, "wb");
+		if (ofp) {
+			struct stat st;
+			bool regular = fstat(fileno(ofp), &st) == 0 && S_ISREG(st.st_mode);
+			r = DoFile(fp, ofp, pp, arena);
+			if (fclose(ofp) != 0 && r == kSuccess) {
+				fprintf(stderr, "can't write %s\n", outfilename);
+				r = kWriteError;
 			}
-			fclose(fp);
-			free(icnsname);
-			return r;
+			if (r != kSuccess && regular)
+				remove(outfilename);
+		}
+		else {
+			fprintf(stderr, "can't open %s for writing\n", outfilename);
+			r = kCantOpenFile;
+		}
+	}
+	else
+		r = kOutputExists;
+	if (fp != stdin)
+		fclose(fp);
+	return r;
+}
+
+static bool AddFile(FileList *list, const char *name)
+{
+	if (list->count == list->capacity) {
+		long newcap = list->capacity ? list->capacity * 2 : 64;
+		char **p = realloc(list->names, newcap * sizeof(char *));
+		if (p == NULL)
+			return 0;
+		list->names = p;
+		list->capacity = newcap;
+	}
+	list->names[list->count] = strdup(name);
+	if (list->names[list->count] == NULL)
+		return 0;
+	list->count++;
+	return 1;
+}
+
+// read file names separated by sep ('\n' or '\0') from fp
+static bool ReadFileList(FileList *list, FILE *fp, int sep)
+{
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	bool ok = 1;
+	while (ok && (len = getdelim(&line, &linecap, sep, fp)) > 0) {
+		if (line[len - 1] == sep)
+			line[--len] = 0;
+		if (sep == '\n' && len > 0 && line[len - 1] == '\r')
+			line[--len] = 0;
+		if (len > 0)
+			ok = AddFile(list, line);
+	}
+	free(line);
+	return ok;
+}
+
+static const char * ResultString(int r)
+{
+	switch (r) {
+	case kCantOpenFile:
+		return "can't open file";
+	case kOutputExists:
+		return "output exists";
+	}
+	return Exe2ICNSResultString(r);
+}
+
+struct BatchJob_ {
+	const Parameters *pp;
+	char **names;
+	int *results;
+	Exe2ICNSArena **arenas;	// one per worker, so that they're never shared
+};
+typedef struct BatchJob_ BatchJob;
+
+static void ConvertBatchFile(void *ctx, long index, int worker)
+{
+	BatchJob *job = ctx;
+	const char *name = job->names[index];
+	char *outfilename = MakeOutputName(name, job->pp->outdir);
+	fprintf(stderr, "=== %s\n", name);
+	if (outfilename == NULL || strcmp(name, "-") == 0) {
+		fprintf(stderr, "can't convert stdin in batch mode\n");
+		job->results[index] = kCantOpenFile;
+	}
+	else
+		job->results[index] = ConvertFile(job->pp, job->arenas ? job->arenas[worker] : NULL, name, outfilename);
+	free(outfilename);
+}
+
+// convert every file and print a summary; returns the exit status
+int DoBatch(const Parameters *pp)
+{
+	BatchJob job;
+	FileList list = { NULL, 0, 0 };
+	int *results;
+	long counts[7] = { 0 };	// success, invalid, no icon, can't open, can't write, skipped, other
+	long i;
+	long nfailed;
+	bool ok = 1;
+	
+	for (i = 0; ok && i < pp->ninfiles; i++)
+		ok = AddFile(&list, pp->infilenames[i]);
+	if (ok && pp->listfilename) {
+		FILE *fp = strcmp(pp->listfilename, "-") == 0 ? stdin : fopen(pp->listfilename, "r");
+		if (fp == NULL) {
+			fprintf(stderr, "can't open %s\n", pp->listfilename);
+			ok = 0;
 		}
 		else {
-			fprintf(stderr, "can't open %s\n", pr.infilename);
-			return 1;
+			ok = ReadFileList(&list, fp, '\n');
+			if (fp != stdin)
+				fclose(fp);
+		}
+	}
+	if (ok && pp->nulseparated)
+		ok = ReadFileList(&list, stdin, '\0');
+	results = ok ? calloc(list.count + 1, sizeof(int)) : NULL;
+	if (results == NULL) {
+		fprintf(stderr, "can't build the file list\n");
+		for (i = 0; i < list.count; i++)
+			free(list.names[i]);
+		free(list.names);
+		return 1;
+	}
+	
+	job.pp = pp;
+	job.names = list.names;
+	job.results = results;
+	// a worker whose arena can't be made just uses malloc
+	job.arenas = calloc(pp->nthreads, sizeof(Exe2ICNSArena *));
+	for (i = 0; job.arenas && i < pp->nthreads; i++)
+		job.arenas[i] = Exe2ICNSArenaCreate(kArenaSize);
+	RunTasks(list.count, pp->nthreads, ConvertBatchFile, &job);
+	for (i = 0; job.arenas && i < pp->nthreads; i++)
+		Exe2ICNSArenaDestroy(job.arenas[i]);
+	free(job.arenas);
+	
+	// summary
+	for (i = 0; i < list.count; i++) {
+		switch (results[i]) {
+		case kSuccess:		counts[0]++; break;
+		case kInvalidFile:	counts[1]++; break;
+		case kExeHasNoIcon:	counts[2]++; break;
+		case kCantOpenFile:	counts[3]++; break;
+		case kWriteError:	counts[4]++; break;
+		case kOutputExists:	counts[5]++; break;
+		default:		counts[6]++; break;
+		}
+	}
+	nfailed = list.count - counts[0] - counts[5];
+	fprintf(stderr, "%ld file(s): %ld converted, %ld skipped, %ld failed\n", list.count, counts[0], counts[5], nfailed);
+	if (nfailed > 0) {
+		fprintf(stderr, "  %ld invalid, %ld without icon, %ld can't be opened, %ld can't be written, %ld other\n", counts[1], counts[2], counts[3], counts[4], counts[6]);
+		for (i = 0; i < list.count; i++) {
+			if (results[i] != kSuccess && results[i] != kOutputExists)
+				fprintf(stderr, "  %s: %s\n", list.names[i], ResultString(results[i]));
+		}
+	}
+	
+	for (i = 0; i < list.count; i++)
+		free(list.names[i]);
+	free(list.names);
+	free(results);
+	return nfailed > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	Parameters pr;
+	
+	if (ParseArgs(argc, argv, &pr)) {
+		char *icnsname = NULL;
+		int r;
+		if (pr.batch)
+			return DoBatch(&pr);
+		if (pr.outfilename == NULL) {
+			icnsname = MakeOutputName(pr.infilenames[0], NULL);
+			pr.outfilename = icnsname;
 		}
+		r = ConvertFile(&pr, NULL, pr.infilenames[0], pr.outfilename);
+		free(icnsname);
+		// i/o errors used to be reported as 1
+		if (r == kCantOpenFile || r == kOutputExists)
+			r = 1;
+		return r;
 	}
 	else {
 		Usage(stderr);
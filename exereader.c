@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "exereader.h"
+#include "arena.h"
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+enum {
+	kBlockSize = 4096
+};
+
+static void * LoadFile(FILE *fp, long *outlenp)
+{
+	const long kChunkSize = 16384;
+	char *buf = NULL;
+	char *p;
+	long datalen = 0;
+	long bufsize = kChunkSize;
+	long c;
+	do {
+		p = realloc(buf, bufsize + kChunkSize);
+		if (p == NULL)
+			break;
+		buf = p;
+		bufsize += kChunkSize;
+		c = fread(&buf[datalen], 1, bufsize - datalen, fp);
+		if (c <= 0)
+			break;
+		datalen += c;
+	} while (1);
+	if (outlenp)
+		*outlenp = datalen;
+	return buf;
+}
+
+int ExeReaderOpen(ExeReader *reader, FILE *fp, int mode, const Exe2ICNSContext *ctx)
+{
+	struct stat st;
+	int fd = fileno(fp);
+	int regular = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+	
+	reader->data = NULL;
+	reader->size = 0;
+	reader->mode = kReaderLoad;
+	reader->fd = fd;
+	reader->loaded = NULL;
+	reader->bytesread = 0;
+	reader->ctx = ctx;
+	
+	if (regular && mode == kReaderMap) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			reader->data = p;
+			reader->size = st.st_size;
+			reader->mode = kReaderMap;
+			return 0;
+		}
+	}
+	else if (regular && mode == kReaderSelective) {
+		// reserve the address space only; blocks are filled in by ExeReaderGet
+		void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (p != MAP_FAILED) {
+			reader->loaded = calloc((st.st_size + kBlockSize - 1) / kBlockSize, 1);
+			if (reader->loaded) {
+				reader->data = p;
+				reader->size = st.st_size;
+				reader->mode = kReaderSelective;
+				return 0;
+			}
+			munmap(p, st.st_size);
+		}
+	}
+	
+	// pipes, stdin and whatever couldn't be mapped
+	reader->data = LoadFile(fp, &reader->size);
+	reader->bytesread = reader->size;
+	return reader->data ? 0 : -1;
+}
+
+void ExeReaderOpenMemory(ExeReader *reader, const void *data, long size)
+{
+	reader->data = data;
+	reader->size = size;
+	reader->mode = kReaderMemory;
+	reader->fd = -1;
+	reader->loaded = NULL;
+	reader->bytesread = size;
+	reader->ctx = NULL;
+}
+
+void ExeReaderClose(ExeReader *reader)
+{
+	if (reader->mode == kReaderLoad)
+		free((void *)reader->data);
+	else if (reader->mode != kReaderMemory && reader->data)
+		munmap((void *)reader->data, reader->size);
+	free(reader->loaded);
+	reader->data = NULL;
+	reader->loaded = NULL;
+	reader->size = 0;
+}
+
+// read blocks [first, last) with as few preads as possible
+static int FetchBlocks(ExeReader *reader, long first, long last)
+{
+	long b = first;
+	while (b < last) {
+		long end;
+		long off, len;
+		if (reader->loaded[b]) {
+			b++;
+			continue;
+		}
+		for (end = b + 1; end < last && ! reader->loaded[end]; end++)
+			;
+		off = b * kBlockSize;
+		len = end * kBlockSize;
+		if (len > reader->size)
+			len = reader->size;
+		len -= off;
+		while (len > 0) {
+			ssize_t r = pread(reader->fd, (char *)reader->data + off, len, off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				LogMessage(reader->ctx, kExe2ICNSLogError, "can't read %ld bytes at %08lX", len, off);
+				return -1;
+			}
+			reader->bytesread += r;
+			off += r;
+			len -= r;
+		}
+		memset(reader->loaded + b, 1, end - b);
+		b = end;
+	}
+	return 0;
+}
+
+const void * ExeReaderGet(ExeReader *reader, long off, long len)
+{
+	if (off < 0 || len < 0 || off > reader->size || len > reader->size - off)
+		return NULL;
+	if (reader->mode == kReaderSelective && len > 0) {
+		if (FetchBlocks(reader, off / kBlockSize, (off + len + kBlockSize - 1) / kBlockSize) != 0)
+			return NULL;
+	}
+	return reader->data + off;
+}
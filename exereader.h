@@ -0,0 +1,36 @@
+#ifndef EXEREADER_H
+#define EXEREADER_H 1
+
+#include <stdio.h>
+#include "exe2icns.h"
+
+// how the executable is brought into memory
+enum {
+	kReaderMap = 0,	// mmap, falls back to kReaderLoad for pipes etc.
+	kReaderLoad = 1,	// read the whole file into a malloc'ed buffer
+	kReaderSelective = 2,	// pread only the blocks that are actually looked at
+	kReaderMemory = 3,	// somebody else's buffer (ExeReaderOpenMemory)
+};
+
+struct ExeReader_ {
+	const char *data;	// whole file; with kReaderSelective only the fetched blocks are valid
+	long size;
+	int mode;	// the mode actually in use
+	int fd;
+	unsigned char *loaded;	// kReaderSelective: one flag per block
+	long bytesread;	// bytes actually read from the file
+	const Exe2ICNSContext *ctx;	// where a failed read is logged; NULL to keep quiet
+};
+typedef struct ExeReader_ ExeReader;
+
+// returns 0 on success
+int ExeReaderOpen(ExeReader *reader, FILE *fp, int mode, const Exe2ICNSContext *ctx);
+// data must stay there until ExeReaderClose
+void ExeReaderOpenMemory(ExeReader *reader, const void *data, long size);
+void ExeReaderClose(ExeReader *reader);
+
+// pointer to file bytes [off, off + len), or NULL if the range is outside of the file or can't be read
+// the pointer stays valid until ExeReaderClose
+const void * ExeReaderGet(ExeReader *reader, long off, long len);
+
+#endif
@@ -2,19 +2,28 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "icnsbuilder.h"
+#include "arena.h"
+
+// the RLE encoder works on separate r, g, b planes so that runs can be found 16 or 32 bytes at a time
+// SSE2 is always there on x86-64; AVX2 is used when the compiler is allowed to (-mavx2)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RLE_USE_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RLE_USE_SSE2 1
+#endif
 
 enum {
 	kFileHeaderSize	= 8,
-	kIconHeaderSize = 8
-};
-
-struct RGB_ {
-	uint8_t r;
-	uint8_t g;
-	uint8_t b;
+	kIconHeaderSize = 8,
+	kInitialCapacity = 4096,
+	kMaxSegments = 16	// iovecs per writev
 };
-typedef struct RGB_ RGB;
 
 // these must be able to handle unaligned addresses
 static void Put16(void *mem, long offset, int16_t value)
@@ -34,171 +43,396 @@ static void Put32(void *mem, long offset, int32_t value)
 	p[3] = value;
 }
 
+// first pos >= start where 3 equal bytes begin, or n if there's none
+static long FindRunStart(const uint8_t *plane, long start, long n)
+{
+	long pos = start;
+#if RLE_USE_AVX2
+	for (; pos + 34 <= n; pos += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(plane + pos));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(plane + pos + 1));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(plane + pos + 2));
+		uint32_t hits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, b), _mm256_cmpeq_epi8(b, c)));
+		if (hits)
+			return pos + __builtin_ctz(hits);
+	}
+#elif RLE_USE_SSE2
+	for (; pos + 18 <= n; pos += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(plane + pos));
+		__m128i b = _mm_loadu_si128((const __m128i *)(plane + pos + 1));
+		__m128i c = _mm_loadu_si128((const __m128i *)(plane + pos + 2));
+		int hits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)));
+		if (hits)
+			return pos + __builtin_ctz(hits);
+	}
+#endif
+	for (; pos + 2 < n; pos++)
+		if (plane[pos] == plane[pos + 1] && plane[pos] == plane[pos + 2])
+			return pos;
+	return n;
+}
 
-RGB palette16[16];
-RGB palette256[256];
-
-static void MakePalette16(void)
-{
-	// RGBColor from clut id 4
-	static const uint16_t clut4[] = {
-		0xFFFF, 0xFFFF, 0xFFFF,
-		0xFC00, 0xF37D, 0x052F,	// yellow
-		0xFFFF, 0x648A, 0x028C,	// orange
-		0xDD6B, 0x08C2, 0x06A2,	// red
-		0xF2D7, 0x0856, 0x84EC,	// magenta
-		0x46E3, 0x0000, 0xA53E,	// purple
-		0x0000, 0x0000, 0xD400,	// blue
-		0x0241, 0xAB54, 0xEAFF,	// cyan
-		0x1F21, 0xB793, 0x1431,	// light green
-		0x0000, 0x64AF, 0x11B0,	// dark green
-		0x5600, 0x2C9D, 0x0524,	// brown
-		0x90D7, 0x7160, 0x3A34,	// light brown
-		0xC000, 0xC000, 0xC000,	// light grey
-		0x8000, 0x8000, 0x8000,	// grey
-		0x4000, 0x4000, 0x4000,	// dark grey
-		0x0000, 0x0000, 0x0000,	// black
-	};
-	int i;
-	for (i = 0; i < 16; i++) {
-		palette16[i].r = clut4[i*3+0] >> 8;
-		palette16[i].g = clut4[i*3+1] >> 8;
-		palette16[i].b = clut4[i*3+2] >> 8;
-	}
-}
-static void MakePalette256(void)
-{
-	int i;
-	uint8_t grad[] = {
-		0xEE, 0xDD, 0xBB, 0xAA, 0x88, 0x77, 0x55, 0x44, 0x22, 0x11
-	};
-	for (i = 0; i < 215; i++) {
-		palette256[i].r = 0xFF - 0x33 * (i / 36);
-		palette256[i].g = 0xFF - 0x33 * ((i / 6) % 6);
-		palette256[i].b = 0xFF - 0x33 * (i % 6);
-	}
-	for (i = 0; i < 10; i++) {
-		palette256[215+i].r = grad[i];
-		palette256[225+i].g = grad[i];
-		palette256[235+i].b = grad[i];
-		palette256[245+i].r = grad[i];
-		palette256[245+i].g = grad[i];
-		palette256[245+i].b = grad[i];
-	}
-	palette256[255].r = 0;
-	palette256[255].g = 0;
-	palette256[255].b = 0;
-}
-
-long ICNSCompressChannel(const void *imgdata, int channeloff, long npixels, void *dest)
-{
-	const int8_t *base = imgdata;
-	int8_t *q = dest;
-	long pos = 0;
-	long runstart = 0;
-	long i;
-	const int step = 4;	// bytes per pixel
-	base += channeloff;
-	while (pos < npixels) {
-		int8_t byte = base[pos*step];
-		// count # of same bytes
-		for (i = 1; i < 130; i++)
-			if (base[pos*step] != base[(pos+i)*step])
-				break;
-		if (i > npixels - pos)
-			i = npixels - pos;
-		if (i >= 3) {
-			while (runstart < pos) {
-				long run = pos - runstart;
-				long j;
-				if (run > 128)
-					run = 128;
-				*q++ = run - 1;
-				for (j = 0; j < run; j++)
-					q[j] = base[(runstart+j) * step];
-				q += run;
-				runstart += run;
-			}
-			*q++ = i - 3 - 128;
-			*q++ = byte;
-			pos = pos + i;
-			runstart = pos;
-		}
-		else {
-			pos += i;
-		}
+// number of bytes equal to plane[pos] starting there, at most limit
+static long RunLength(const uint8_t *plane, long pos, long limit)
+{
+	const uint8_t *p = plane + pos;
+	long i = 0;
+#if RLE_USE_AVX2
+	__m256i byte = _mm256_set1_epi8(p[0]);
+	for (; i + 32 <= limit; i += 32) {
+		uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), byte));
+		if (same != 0xFFFFFFFF)
+			return i + __builtin_ctz(~same);
+	}
+#elif RLE_USE_SSE2
+	__m128i byte = _mm_set1_epi8(p[0]);
+	for (; i + 16 <= limit; i += 16) {
+		int same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), byte));
+		if (same != 0xFFFF)
+			return i + __builtin_ctz(~same);
 	}
-	while (runstart < pos) {
-		long run = pos - runstart;
-		long j;
-		if (run > 128)
-			run = 128;
+#endif
+	while (i < limit && p[i] == p[0])
+		i++;
+	return i;
+}
+
+// literal packets of up to 128 bytes
+static int8_t * PutLiterals(int8_t *q, const uint8_t *src, long count)
+{
+	while (count > 0) {
+		long run = count > 128 ? 128 : count;
 		*q++ = run - 1;
-		for (j = 0; j < run; j++)
-			q[j] = base[(runstart+j) * step];
+		memcpy(q, src, run);
 		q += run;
-		runstart += run;
+		src += run;
+		count -= run;
+	}
+	return q;
+}
+
+// 3 to 130 equal bytes become a run packet; everything else is copied as literals
+static long ICNSCompressPlane(const uint8_t *plane, long npixels, void *dest)
+{
+	int8_t *q = dest;
+	long pos = 0;
+	while (pos < npixels) {
+		long runstart = FindRunStart(plane, pos, npixels);
+		long len;
+		q = PutLiterals(q, plane + pos, runstart - pos);
+		if (runstart >= npixels)
+			break;
+		len = RunLength(plane, runstart, npixels - runstart < 130 ? npixels - runstart : 130);
+		*q++ = len - 3 - 128;
+		*q++ = plane[runstart];
+		pos = runstart + len;
 	}
 	return q - (int8_t *)dest;
 }
 
-long ICNSCompressImage(uint32_t tag, const void *imgdata, long datasize, void *dest)
+long ICNSCompressedSizeBound(uint32_t tag, long npixels)
+{
+	// a channel is worst as all literals: one count byte per 128 bytes
+	// a run saves at least one byte, which pays for the count byte of the literals after it
+	return ICNSCompressedPadSizeForTag(tag) + 3 * (npixels + npixels / 128 + 2);
+}
+
+long ICNSCompressImage(uint32_t tag, const Image *image, void *dest)
 {
 	int8_t *q = dest;
-	long len;
 	long padbytes = ICNSCompressedPadSizeForTag(tag);
+	long npixels = (long)image->width * image->height;
+	int c;
 	memset(dest, 0, padbytes);
 	q += padbytes;
-	len = ICNSCompressChannel(imgdata, 1, datasize / 4, q);
-	q += len;
-	len = ICNSCompressChannel(imgdata, 2, datasize / 4, q);
-	q += len;
-	len = ICNSCompressChannel(imgdata, 3, datasize / 4, q);
-	q += len;
+	for (c = kImageR; c <= kImageB; c++)
+		q += ICNSCompressPlane(image->planes[c], npixels, q);
 	return q - (int8_t *)dest;
 }
 
+// make capacity at least size, doubling it so that a series of adds reallocates only a few times
 static int Grow(ICNSBuilder *builder, long size)
 {
-	char *p = realloc(builder->data, size);
-	if (p) {
-		builder->data = p;
-		builder->capacity = size;
-		builder->length = size;
-		Put32(builder->data, 4, builder->length);
+	long capacity = builder->capacity > 0 ? builder->capacity : kInitialCapacity;
+	char *p;
+	if (size <= builder->capacity)
 		return 1;
-	}
-	return 0;
+	while (capacity < size)
+		capacity *= 2;
+	p = MemResize(builder->allocator, builder->data, capacity);
+	if (p == NULL)
+		return 0;
+	builder->data = p;
+	builder->capacity = capacity;
+	return 1;
+}
+
+int ICNSBuilderInit(ICNSBuilder *builder)
+{
+	return ICNSBuilderInitWithSink(builder, NULL, NULL);
 }
 
-void ICNSBuilderInit(ICNSBuilder *builder)
+int ICNSBuilderInitWithSink(ICNSBuilder *builder, ICNSSink *sink, const Exe2ICNSAllocator *allocator)
 {
 	builder->data = NULL;
 	builder->capacity = 0;
 	builder->length = 0;
+	builder->flushed = 0;
+	builder->pending = -1;
+	builder->referenced = 0;
+	builder->refs = NULL;
+	builder->nrefs = 0;
+	builder->refcapacity = 0;
+	builder->sink = sink;
+	builder->allocator = allocator;
 	
-	Grow(builder, kFileHeaderSize);
+	if (! Grow(builder, kFileHeaderSize))
+		return kICNSOutOfMemory;
+	builder->length = kFileHeaderSize;
 	Put32(builder->data, 0, 'icns');
+	Put32(builder->data, 4, builder->length);
+	return 0;
+}
+
+static long WriteToSink(ICNSSink *sink, const void *data, long size)
+{
+	switch (sink->kind) {
+	case kICNSSinkFile:
+		return fwrite(data, 1, size, sink->fp) == size ? size : -1;
+	case kICNSSinkFD:
+		{
+			const char *p = data;
+			long done = 0;
+			while (done < size) {
+				ssize_t n = write(sink->fd, p + done, size - done);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return -1;
+				done += n;
+			}
+			return done;
+		}
+	}
+	return -1;
+}
+
+// write n pieces one after another; a file descriptor gets them with as few writev calls as it takes
+static int WriteSegments(ICNSSink *sink, struct iovec *iov, int n)
+{
+	if (sink->kind == kICNSSinkFD) {
+		while (n > 0) {
+			ssize_t done = writev(sink->fd, iov, n < kMaxSegments ? n : kMaxSegments);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0)
+				return kICNSWriteError;
+			// skip what went out, which may end in the middle of a piece
+			while (n > 0 && done >= (ssize_t)iov->iov_len) {
+				done -= iov->iov_len;
+				iov++;
+				n--;
+			}
+			if (n > 0) {
+				iov->iov_base = (char *)iov->iov_base + done;
+				iov->iov_len -= done;
+			}
+		}
+	}
+	else {
+		int i;
+		for (i = 0; i < n; i++) {
+			if (iov[i].iov_len > 0 && WriteToSink(sink, iov[i].iov_base, iov[i].iov_len) != iov[i].iov_len)
+				return kICNSWriteError;
+		}
+	}
+	return 0;
+}
+
+static int SeekSink(ICNSSink *sink, long offset)
+{
+	switch (sink->kind) {
+	case kICNSSinkFile:
+		return fseek(sink->fp, offset, SEEK_SET);
+	case kICNSSinkFD:
+		return lseek(sink->fd, offset, SEEK_SET) < 0 ? -1 : 0;	// devices like /dev/null always say 0
+	}
+	return -1;
+}
+
+void ICNSSinkInitFile(ICNSSink *sink, FILE *fp)
+{
+	memset(sink, 0, sizeof(ICNSSink));
+	sink->kind = kICNSSinkFile;
+	sink->fp = fp;
+	sink->start = ftell(fp);	// -1 for pipes and terminals
+}
+
+void ICNSSinkInitFD(ICNSSink *sink, int fd)
+{
+	memset(sink, 0, sizeof(ICNSSink));
+	sink->kind = kICNSSinkFD;
+	sink->fd = fd;
+	sink->start = lseek(fd, 0, SEEK_CUR);
+}
+
+#define IsStreaming(builder) ((builder)->sink && (builder)->sink->start >= 0)
+
+// write out whatever is complete; the header goes out with the first element, its length still unpatched
+static int Flush(ICNSBuilder *builder)
+{
+	long size = builder->length - builder->flushed - builder->referenced;
+	if (! IsStreaming(builder) || builder->pending >= 0 || size == 0)
+		return 0;
+	if (WriteToSink(builder->sink, builder->data, size) != size)
+		return kICNSWriteError;
+	builder->flushed = builder->length;
+	return 0;
+}
+
+// patch the total length in the header; without a sink it's already up to date
+int ICNSBuilderFinish(ICNSBuilder *builder)
+{
+	ICNSSink *sink = builder->sink;
+	uint8_t len[4];
+	if (sink == NULL)
+		return 0;
+	if (! IsStreaming(builder)) {
+		// all of it is still here, apart from the references, which go in between
+		long size = builder->length - builder->referenced;
+		struct iovec *iov = MemAlloc(builder->allocator, (2 * builder->nrefs + 1) * sizeof(struct iovec));
+		long off = 0;
+		int i, n = 0, r;
+		if (iov == NULL)
+			return kICNSOutOfMemory;
+		for (i = 0; i < builder->nrefs; i++) {
+			const ICNSReference *ref = &builder->refs[i];
+			iov[n].iov_base = builder->data + off;
+			iov[n++].iov_len = ref->offset - off;
+			iov[n].iov_base = (void *)ref->data;
+			iov[n++].iov_len = ref->size;
+			off = ref->offset;
+		}
+		iov[n].iov_base = builder->data + off;
+		iov[n++].iov_len = size - off;
+		r = WriteSegments(sink, iov, n);
+		MemFree(builder->allocator, iov);
+		return r;
+	}
+	if (Flush(builder) != 0)
+		return kICNSWriteError;
+	Put32(len, 0, builder->length);
+	if (SeekSink(sink, sink->start + 4) != 0 || WriteToSink(sink, len, 4) != 4)
+		return kICNSWriteError;
+	if (SeekSink(sink, sink->start + builder->length) != 0)
+		return kICNSWriteError;
+	return 0;
+}
+
+int ICNSBuilderReserve(ICNSBuilder *builder, long size)
+{
+	if (IsStreaming(builder))
+		return 0;
+	return Grow(builder, size) ? 0 : kICNSOutOfMemory;
 }
 
 void ICNSBuilderTerminate(ICNSBuilder *builder)
 {
-	free(builder->data);
+	MemFree(builder->allocator, builder->data);
+	MemFree(builder->allocator, builder->refs);
 	builder->data = NULL;
 	builder->capacity = 0;
 	builder->length = 0;
+	builder->flushed = 0;
+	builder->referenced = 0;
+	builder->refs = NULL;
+	builder->nrefs = 0;
+	builder->refcapacity = 0;
+}
+
+// the header length is kept current while it's still in memory
+static void SetLength(ICNSBuilder *builder, long length)
+{
+	builder->length = length;
+	if (builder->flushed == 0)
+		Put32(builder->data, 4, length);
 }
 
 int ICNSAddData(ICNSBuilder *builder, uint32_t tag, const void *data, long size)
 {
-	long off = builder->length;
-	Grow(builder, off + kIconHeaderSize + size);
+	long off = builder->length - builder->flushed - builder->referenced;
+	if (! Grow(builder, off + kIconHeaderSize + size))
+		return kICNSOutOfMemory;
 	Put32(builder->data, off + 0, tag);
 	Put32(builder->data, off + 4, size + kIconHeaderSize);
 	memmove(builder->data + off + kIconHeaderSize, data, size);
+	SetLength(builder, builder->length + kIconHeaderSize + size);
+	return Flush(builder);
+}
+
+int ICNSAddReference(ICNSBuilder *builder, uint32_t tag, const void *data, long size)
+{
+	long off = builder->length - builder->flushed - builder->referenced;
+	if (builder->sink == NULL)
+		return ICNSAddData(builder, tag, data, size);
+	if (! Grow(builder, off + kIconHeaderSize))
+		return kICNSOutOfMemory;
+	Put32(builder->data, off + 0, tag);
+	Put32(builder->data, off + 4, size + kIconHeaderSize);
+	off += kIconHeaderSize;
+	if (IsStreaming(builder)) {
+		// what's been held back plus the header, then the payload
+		struct iovec iov[2];
+		iov[0].iov_base = builder->data;
+		iov[0].iov_len = off;
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = size;
+		if (WriteSegments(builder->sink, iov, 2) != 0)
+			return kICNSWriteError;
+		builder->length += kIconHeaderSize + size;
+		builder->flushed = builder->length;
+		return 0;
+	}
+	if (builder->nrefs == builder->refcapacity) {
+		int capacity = builder->refcapacity > 0 ? 2 * builder->refcapacity : 4;
+		ICNSReference *p = MemResize(builder->allocator, builder->refs, capacity * sizeof(ICNSReference));
+		if (p == NULL)
+			return kICNSOutOfMemory;
+		builder->refs = p;
+		builder->refcapacity = capacity;
+	}
+	builder->refs[builder->nrefs].offset = off;
+	builder->refs[builder->nrefs].data = data;
+	builder->refs[builder->nrefs].size = size;
+	builder->nrefs++;
+	builder->referenced += size;
+	SetLength(builder, builder->length + kIconHeaderSize + size);
 	return 0;
 }
 
+void * ICNSBeginData(ICNSBuilder *builder, uint32_t tag, long maxsize)
+{
+	long off = builder->length - builder->flushed - builder->referenced;
+	if (! Grow(builder, off + kIconHeaderSize + maxsize))
+		return NULL;
+	Put32(builder->data, off + 0, tag);
+	builder->pending = off;
+	return builder->data + off + kIconHeaderSize;
+}
+
+int ICNSEndData(ICNSBuilder *builder, long size)
+{
+	long off = builder->pending;
+	if (off < 0)
+		return 0;
+	builder->pending = -1;
+	if (size < 0)
+		return 0;
+	Put32(builder->data, off + 4, size + kIconHeaderSize);
+	SetLength(builder, builder->flushed + builder->referenced + off + kIconHeaderSize + size);
+	return Flush(builder);
+}
+
 long ICNSBuilderGetSize(ICNSBuilder *builder)
 {
 	return builder->length;
@@ -208,3 +442,128 @@ void * ICNSBuilderGetDataPtr(ICNSBuilder *builder)
 {
 	return builder->data;
 }
+
+void * ICNSBuilderDetachData(ICNSBuilder *builder)
+{
+	void *p = builder->data;
+	builder->data = NULL;
+	builder->capacity = 0;
+	return p;
+}
+
+#ifdef TEST
+
+// the plain one-byte-at-a-time encoder the vector one has to match
+static long ReferenceCompressPlane(const uint8_t *plane, long n, int8_t *q)
+{
+	int8_t *start = q;
+	long pos = 0;
+	long literals = 0;	// pending, ending at pos
+	while (pos <= n) {
+		if (pos == n || (pos + 2 < n && plane[pos] == plane[pos + 1] && plane[pos] == plane[pos + 2])) {
+			long len = 0;
+			q = PutLiterals(q, plane + pos - literals, literals);
+			literals = 0;
+			if (pos == n)
+				break;
+			while (pos + len < n && len < 130 && plane[pos + len] == plane[pos])
+				len++;
+			*q++ = len - 3 - 128;
+			*q++ = plane[pos];
+			pos += len;
+		}
+		else {
+			literals++;
+			pos++;
+		}
+	}
+	return q - start;
+}
+
+// packets -> bytes, to make sure the output also means the right thing
+static long Decompress(const int8_t *p, long size, uint8_t *out)
+{
+	const int8_t *end = p + size;
+	long n = 0;
+	while (p < end) {
+		int count = *p++;
+		if (count >= 0) {
+			memcpy(out + n, p, count + 1);
+			p += count + 1;
+			n += count + 1;
+		}
+		else {
+			memset(out + n, (uint8_t)*p++, count + 128 + 3);
+			n += count + 128 + 3;
+		}
+	}
+	return n;
+}
+
+static int Check(const char *name, const uint8_t *plane, long n)
+{
+	static int8_t packed[2][70000];
+	static uint8_t unpacked[70000];
+	long size = ICNSCompressPlane(plane, n, packed[0]);
+	long refsize = ReferenceCompressPlane(plane, n, packed[1]);
+	if (size != refsize || memcmp(packed[0], packed[1], size) != 0) {
+		fprintf(stderr, "%s, %ld bytes: %ld bytes packed, should be %ld\n", name, n, size, refsize);
+		return 1;
+	}
+	if (size > ICNSCompressedSizeBound('is32', n) / 3 || Decompress(packed[0], size, unpacked) != n || memcmp(unpacked, plane, n) != 0) {
+		fprintf(stderr, "%s, %ld bytes: doesn't unpack to the plane\n", name, n);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t plane[65536];
+	static const int runs[] = { 1, 2, 3, 4, 127, 128, 129, 130, 131, 132, 260, 261 };
+	static const long lengths[] = { 0, 1, 2, 3, 15, 16, 17, 18, 31, 32, 33, 34, 35, 255, 1024, 2304, 16384, 65535, 65536 };
+	int errors = 0;
+	int i, j, k;
+	long n;
+	
+	srand(1);
+	for (i = 0; i < sizeof(lengths) / sizeof(long); i++) {
+		n = lengths[i];
+		for (k = 0; k < n; k++)
+			plane[k] = rand();
+		errors += Check("random", plane, n);
+		// few values, so that short runs turn up everywhere
+		for (k = 0; k < n; k++)
+			plane[k] = rand() % 3;
+		errors += Check("3 values", plane, n);
+		memset(plane, 77, n);
+		errors += Check("constant", plane, n);
+	}
+	
+	// runs of each length around the 3 byte minimum and the 130 byte maximum, between literals,
+	// at every offset across a vector and an odd plane length
+	for (i = 0; i < sizeof(runs) / sizeof(int); i++) {
+		for (j = 0; j < 40; j++) {
+			n = j + runs[i] + 37;
+			for (k = 0; k < n; k++)
+				plane[k] = k;
+			memset(plane + j, 200, runs[i]);
+			errors += Check("run", plane, n);
+			// the run at the very end
+			errors += Check("run at the end", plane, j + runs[i]);
+		}
+	}
+	
+	// back to back runs of the boundary lengths
+	for (n = 0, i = 0; n < 60000; i++) {
+		int len = runs[i % (sizeof(runs) / sizeof(int))];
+		memset(plane + n, i & 1 ? 9 : 10, len);
+		n += len;
+	}
+	errors += Check("runs", plane, n | 1);
+	
+	printf("%d error(s)\n", errors);
+	return errors != 0;
+}
+
+#endif
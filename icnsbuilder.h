@@ -1,26 +1,94 @@
 #ifndef ICNSBUILDER_H
 #define ICNSBUILDER_H 1
 
+#include <stdio.h>
 #include <stdint.h>
+#include "exe2icns.h"
+#include "image.h"
+
+enum {
+	kICNSOutOfMemory = -1,
+	kICNSWriteError = -2
+};
+
+// where a streaming builder writes the container
+enum {
+	kICNSSinkFile,
+	kICNSSinkFD
+};
+
+struct ICNSSink_ {
+	int kind;
+	FILE *fp;
+	int fd;
+	// set up by the ICNSSinkInit functions
+	long start;	// offset of the container in the output, or -1 if the output isn't seekable
+};
+typedef struct ICNSSink_ ICNSSink;
+
+// element payload added by ICNSAddReference that is still to be written from where it is
+struct ICNSReference_ {
+	long offset;	// in the builder's data, where the payload belongs
+	const void *data;
+	long size;
+};
+typedef struct ICNSReference_ ICNSReference;
 
 struct ICNSBuilder_ {
-	char *data;
+	char *data;	// the bytes not written to the sink yet (everything without a sink), references left out
 	long capacity;
-	long length;
+	long length;	// of the whole container
+	long flushed;	// bytes already written to the sink
+	long pending;	// offset in data of the element opened by ICNSBeginData, or -1
+	long referenced;	// bytes of refs, which are part of length but not of data
+	ICNSReference *refs;
+	int nrefs;
+	int refcapacity;
+	ICNSSink *sink;
+	const Exe2ICNSAllocator *allocator;	// NULL for malloc
 };
 typedef struct ICNSBuilder_ ICNSBuilder;
 
 // it32 seems to need 4-byte have pad before compressed data
-long ICNSCompressImage(uint32_t tag, const void *imgdata, long datasize, void *destbuf);
+// the r, g and b planes of image are compressed one after another; returns the compressed size
+long ICNSCompressImage(uint32_t tag, const Image *image, void *destbuf);
 #define ICNSCompressedPadSizeForTag(tag) ((tag) == 'it32' ? 4 : 0)
+// worst-case ICNSCompressImage output for npixels pixels, pad included
+long ICNSCompressedSizeBound(uint32_t tag, long npixels);
+
+void ICNSSinkInitFile(ICNSSink *sink, FILE *fp);
+void ICNSSinkInitFD(ICNSSink *sink, int fd);
 
-void ICNSBuilderInit(ICNSBuilder *builder);
+// these return 0, kICNSOutOfMemory (the builder keeps what it had), or kICNSWriteError
+
+// without a sink the container is kept in memory for ICNSBuilderGetDataPtr
+int ICNSBuilderInit(ICNSBuilder *builder);
+// with a sink every element is written out as soon as it's complete, and the header is patched
+// by ICNSBuilderFinish; an output that can't be rewound gets the whole container at the end instead
+// sink and allocator may be NULL
+int ICNSBuilderInitWithSink(ICNSBuilder *builder, ICNSSink *sink, const Exe2ICNSAllocator *allocator);
+int ICNSBuilderFinish(ICNSBuilder *builder);
 void ICNSBuilderTerminate(ICNSBuilder *builder);
 
 int ICNSAddData(ICNSBuilder *builder, uint32_t tag, const void *data, long size);
+// like ICNSAddData, but with a sink the payload isn't copied: it's written from data (with writev for a file
+// descriptor), right away when streaming or by ICNSBuilderFinish otherwise, so data must stay there until then
+// without a sink it's copied like ICNSAddData, as the container has to be in one piece
+int ICNSAddReference(ICNSBuilder *builder, uint32_t tag, const void *data, long size);
+// make room for a container of size bytes in total, so that adding up to that doesn't reallocate
+// (leave out the ICNSAddReference payloads when there's a sink); does nothing for a builder that streams to its sink
+int ICNSBuilderReserve(ICNSBuilder *builder, long size);
+
+// write an element in place: ICNSBeginData returns room for maxsize bytes of payload (NULL if out of memory),
+// ICNSEndData sets the actual size and patches the element length; a negative size drops the element
+void * ICNSBeginData(ICNSBuilder *builder, uint32_t tag, long maxsize);
+int ICNSEndData(ICNSBuilder *builder, long size);
 
 long ICNSBuilderGetSize(ICNSBuilder *builder);
+// only for a builder without a sink
 void * ICNSBuilderGetDataPtr(ICNSBuilder *builder);
+// hand the container over to the caller, who frees it with the builder's allocator
+void * ICNSBuilderDetachData(ICNSBuilder *builder);
 
 #endif
 
@@ -0,0 +1,92 @@
+#include <string.h>
+#include <stdint.h>
+#include "image.h"
+#include "arena.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define IMAGE_USE_SSE2 1
+#endif
+
+int ImageAlloc(Image *image, int width, int height, const Exe2ICNSAllocator *allocator)
+{
+	long npixels = (long)width * height;
+	uint8_t *block = MemAlloc(allocator, kImagePlanes * npixels);
+	int c;
+	memset(image, 0, sizeof(Image));
+	if (block == NULL)
+		return -1;
+	image->width = width;
+	image->height = height;
+	for (c = 0; c < kImagePlanes; c++)
+		image->planes[c] = block + c * npixels;
+	return 0;
+}
+
+void ImageFree(Image *image, const Exe2ICNSAllocator *allocator)
+{
+	MemFree(allocator, image->planes[0]);
+	memset(image, 0, sizeof(Image));
+}
+
+void ImageGetRGBARow(const Image *image, int row, uint8_t *rgba)
+{
+	long off = (long)row * image->width;
+	const uint8_t *r = image->planes[kImageR] + off;
+	const uint8_t *g = image->planes[kImageG] + off;
+	const uint8_t *b = image->planes[kImageB] + off;
+	const uint8_t *a = image->planes[kImageA] + off;
+	int j = 0;
+#if IMAGE_USE_SSE2
+	for (; j + 16 <= image->width; j += 16) {
+		__m128i vr = _mm_loadu_si128((const __m128i *)(r + j));
+		__m128i vg = _mm_loadu_si128((const __m128i *)(g + j));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + j));
+		// r g pairs and b a pairs, then the pairs of pairs
+		__m128i rglo = _mm_unpacklo_epi8(vr, vg), rghi = _mm_unpackhi_epi8(vr, vg);
+		__m128i balo = _mm_unpacklo_epi8(vb, va), bahi = _mm_unpackhi_epi8(vb, va);
+		__m128i *q = (__m128i *)(rgba + 4 * j);
+		_mm_storeu_si128(q + 0, _mm_unpacklo_epi16(rglo, balo));
+		_mm_storeu_si128(q + 1, _mm_unpackhi_epi16(rglo, balo));
+		_mm_storeu_si128(q + 2, _mm_unpacklo_epi16(rghi, bahi));
+		_mm_storeu_si128(q + 3, _mm_unpackhi_epi16(rghi, bahi));
+	}
+#endif
+	for (; j < image->width; j++) {
+		rgba[4*j + 0] = r[j];
+		rgba[4*j + 1] = g[j];
+		rgba[4*j + 2] = b[j];
+		rgba[4*j + 3] = a[j];
+	}
+}
+
+void ImageSetRGBARow(Image *image, int row, const uint8_t *rgba)
+{
+	long off = (long)row * image->width;
+	int j = 0;
+	int c;
+#if IMAGE_USE_SSE2
+	const __m128i lowbyte = _mm_set1_epi32(0xFF);
+	for (; j + 16 <= image->width; j += 16) {
+		const __m128i *p = (const __m128i *)(rgba + 4 * j);
+		__m128i v0 = _mm_loadu_si128(p + 0);
+		__m128i v1 = _mm_loadu_si128(p + 1);
+		__m128i v2 = _mm_loadu_si128(p + 2);
+		__m128i v3 = _mm_loadu_si128(p + 3);
+		for (c = 0; c < kImagePlanes; c++) {
+			// component c is bits 8c ... 8c+7 of each little-endian dword
+			__m128i a0 = _mm_and_si128(_mm_srli_epi32(v0, 8 * c), lowbyte);
+			__m128i a1 = _mm_and_si128(_mm_srli_epi32(v1, 8 * c), lowbyte);
+			__m128i a2 = _mm_and_si128(_mm_srli_epi32(v2, 8 * c), lowbyte);
+			__m128i a3 = _mm_and_si128(_mm_srli_epi32(v3, 8 * c), lowbyte);
+			__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+			_mm_storeu_si128((__m128i *)(image->planes[c] + off + j), bytes);
+		}
+	}
+#endif
+	for (; j < image->width; j++) {
+		for (c = 0; c < kImagePlanes; c++)
+			image->planes[c][off + j] = rgba[4*j + c];
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef IMAGE_H
+#define IMAGE_H 1
+
+#include <stdint.h>
+#include "exe2icns.h"
+
+enum {
+	kImageR,
+	kImageG,
+	kImageB,
+	kImageA,	// the mask
+	kImagePlanes
+};
+
+// 8 bits per component, each component in a plane of its own (width * height bytes, top row first),
+// which is how the icns RLE elements and masks store it
+// the planes are one block, allocated and freed by the functions below
+struct Image_ {
+	int width;
+	int height;
+	uint8_t *planes[kImagePlanes];	// all NULL for an empty image
+};
+typedef struct Image_ Image;
+
+// returns 0, or -1 if out of memory (from allocator, or malloc if NULL), leaving image empty
+int ImageAlloc(Image *image, int width, int height, const Exe2ICNSAllocator *allocator);
+// makes image empty; freeing an empty one does nothing
+void ImageFree(Image *image, const Exe2ICNSAllocator *allocator);
+
+// row of the planes <-> width RGBA pixels, for the formats that want them interleaved
+void ImageGetRGBARow(const Image *image, int row, uint8_t *rgba);
+void ImageSetRGBARow(Image *image, int row, const uint8_t *rgba);
+
+#endif
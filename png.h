@@ -1,12 +1,58 @@
 #ifndef PNG_H
 #define PNG_H 1
 
-// rgb = 32-bit RGB (skipping the 1st byte), mask = 8-bit alpha channel
-// free() the returned pointer by yourself
-void * CompressToPNG(int width, int height, const void *rgb, const void *mask, long *outsize);
+#include "exe2icns.h"
+#include "image.h"
 
-// png -> 32-bit ARGB
-// free() the returned pointer by yourself
-void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei);
+// sets up whatever the backend shares between CompressToPNG and ExpandPNG calls
+// call it once before converting many images; the functions still work without it
+void InitPNGCodec(void);
+
+// whether CompressToPNG and CompressRowsToPNG follow their PNGOptions (only the zlib encoder does)
+int PNGEncoderTakesOptions(void);
+
+// all the memory, including the returned block, comes from the allocator of ctx, and what's wrong with a png
+// goes to its log; a NULL ctx means malloc and no messages
+
+enum {
+	kPNGFilterAdaptive = -1	// each row gets the filter that suits it; 0 ... 4 are the png filter types, used for every row
+};
+
+enum {
+	kPNGStrategyDefault,	// zlib's Z_DEFAULT_STRATEGY
+	kPNGStrategyFiltered,	// Z_FILTERED
+	kPNGStrategyRLE	// Z_RLE
+};
+
+// how the rows are filtered and deflated, for the zlib encoder; the others leave it to the system
+// NULL options are adaptive filtering, level 9, memLevel 8, Z_FILTERED
+struct PNGOptions_ {
+	int filter;
+	int level;	// zlib level, 1 ... 9
+	int memlevel;	// zlib memLevel, 1 ... 9
+	int strategy;
+};
+typedef struct PNGOptions_ PNGOptions;
+
+// image -> RGBA png (the mask is the alpha channel)
+// free the returned pointer by yourself
+void * CompressToPNG(const Image *image, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx);
+
+// fills band (band->width wide) with band->height rows of the image, starting at row first
+typedef void (*PNGRowsFunc)(void *ctx, int first, Image *band);
+
+// like CompressToPNG, but rows are asked for one band after another and encoded as they come,
+// so the image is never whole in memory
+void * CompressRowsToPNG(int width, int height, PNGRowsFunc rows, void *rowsctx, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx);
+
+// how ExpandPNG reads the png; NULL options check every crc
+struct PNGDecodeOptions_ {
+	int crc;	// kExe2ICNSCRCAll, kExe2ICNSCRCSampled or kExe2ICNSCRCNone
+};
+typedef struct PNGDecodeOptions_ PNGDecodeOptions;
+
+// png -> image, allocated at the size of the png; returns 0, or -1 if the png can't be read
+// free image with ImageFree
+int ExpandPNG(const void *png, long pngsize, const PNGDecodeOptions *options, Image *image, const Exe2ICNSContext *ctx);
 
 #endif
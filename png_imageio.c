@@ -1,30 +1,52 @@
 #include <ImageIO/ImageIO.h>
 #include <CoreServices/CoreServices.h>
 #include "png.h"
+#include "arena.h"
 
-void * CompressToPNG(int width, int height, const void *rgb, const void *mask, long *outsize)
+void InitPNGCodec(void)
 {
-	CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault, 0);
-	CGImageDestinationRef dest = CGImageDestinationCreateWithData(data, kUTTypePNG, 1, NULL);
-	CGColorSpaceRef space = CGColorSpaceCreateDeviceRGB();
-	CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, rgb, 4 * width * height, NULL);
+	// nothing to prepare; ImageIO does it all
+}
+
+int PNGEncoderTakesOptions(void)
+{
+	return 0;
+}
+
+void * CompressToPNG(const Image *planes, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
+{
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
+	int width = planes->width;
+	int height = planes->height;
+	UInt8 *argb = MemAlloc(allocator, 4 * width * height);
+	CFMutableDataRef data;
+	CGImageDestinationRef dest;
+	CGColorSpaceRef space;
+	CGDataProviderRef provider;
 	const CGFloat decode[] = { 0, 1, 0, 1, 0, 1 };
 	CGImageRef image;
-	if (mask) {
-		for (int i = 0; i < width * height; i++)
-			((char *)rgb)[i*4] = ((char *)mask)[i];	// ignoring const; should allocate new memory...
-		image = CGImageCreate(width, height, 8, 32, 4 * width, space, kCGImageAlphaFirst, provider, decode, true, kCGRenderingIntentDefault);
-	}
-	else {
-		image = CGImageCreate(width, height, 8, 32, 4 * width, space, kCGImageAlphaNoneSkipFirst, provider, decode, true, kCGRenderingIntentDefault);
+	if (argb == NULL)
+		return NULL;
+	// CoreGraphics wants the pixels interleaved
+	for (long i = 0; i < (long)width * height; i++) {
+		argb[i*4+0] = planes->planes[kImageA][i];
+		argb[i*4+1] = planes->planes[kImageR][i];
+		argb[i*4+2] = planes->planes[kImageG][i];
+		argb[i*4+3] = planes->planes[kImageB][i];
 	}
+	data = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	dest = CGImageDestinationCreateWithData(data, kUTTypePNG, 1, NULL);
+	space = CGColorSpaceCreateDeviceRGB();
+	provider = CGDataProviderCreateWithData(NULL, argb, 4 * width * height, NULL);
+	image = CGImageCreate(width, height, 8, 32, 4 * width, space, kCGImageAlphaFirst, provider, decode, true, kCGRenderingIntentDefault);
 	
 	CGImageDestinationAddImage(dest, image, NULL);
 	CGImageDestinationFinalize(dest);
 	
 	long size = CFDataGetLength(data);
-	void *buf = malloc(size);
-	CFDataGetBytes(data, CFRangeMake(0, size), buf);
+	void *buf = MemAlloc(allocator, size);
+	if (buf)
+		CFDataGetBytes(data, CFRangeMake(0, size), buf);
 	*outsize = size;
 	
 	CGDataProviderRelease(provider);
@@ -32,26 +54,43 @@ void * CompressToPNG(int width, int height, const void *rgb, const void *mask, l
 	CGImageRelease(image);
 	CFRelease(dest);
 	CFRelease(data);
+	MemFree(allocator, argb);
 	
 	return buf;
 }
 
 
-void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
+// the system encoder wants the whole image anyway
+void * CompressRowsToPNG(int width, int height, PNGRowsFunc rows, void *rowsctx, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
 {
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
+	Image image;
+	void *buf;
+	if (ImageAlloc(&image, width, height, allocator) != 0)
+		return NULL;
+	rows(rowsctx, 0, &image);
+	buf = CompressToPNG(&image, options, outsize, ctx);
+	ImageFree(&image, allocator);
+	return buf;
+}
+
+int ExpandPNG(const void *png, long pngsize, const PNGDecodeOptions *options, Image *planes, const Exe2ICNSContext *ctx)
+{
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
 	CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, png, pngsize, NULL);
 	//CGFloat decode[] = { 0, 1, 0, 1, 0, 1, 0, 1 };
 	CGImageRef image = CGImageCreateWithPNGDataProvider(provider, NULL, true, kCGRenderingIntentDefault);
 	int width = CGImageGetWidth(image);
 	int height = CGImageGetHeight(image);
-	char *buf = malloc(4 * width * height);
-	char *buf2 = malloc(4 * width * height);
+	char *buf = MemAlloc(allocator, 4 * width * height);
+	char *buf2 = MemAlloc(allocator, 4 * width * height);
 	// CGContext performs colour space conversion if png has specified some other colours...
 	CGColorSpaceRef space = CGColorSpaceCreateDeviceRGB();
 	//CGColorSpaceRef space = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGB);	// 10.2 - 10.4
 	//CGColorSpaceRef space = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);	// 10.5 -
-	CGContextRef ctx;
+	CGContextRef bitmap;
 	long i;
+	int r = -1;
 	
 	{
 		CGImageRef newimage = CGImageCreateCopyWithColorSpace(image, space);
@@ -62,72 +101,49 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 	}
 	
 	// get alpha channel
-	ctx = CGBitmapContextCreate(buf2, width, height, 8, 4 * width, space, kCGImageAlphaPremultipliedFirst);
-	if (ctx == NULL) {
-		fprintf(stderr, "can't create bitmap context!\n");
-		free(buf);
+	bitmap = CGBitmapContextCreate(buf2, width, height, 8, 4 * width, space, kCGImageAlphaPremultipliedFirst);
+	if (bitmap == NULL) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "can't create bitmap context");
+		MemFree(allocator, buf);
 		buf = NULL;
 	}
-	CGContextDrawImage(ctx, CGRectMake(0, 0, width, height), image);
-	CGContextFlush(ctx);
-	CGContextRelease(ctx);
+	CGContextDrawImage(bitmap, CGRectMake(0, 0, width, height), image);
+	CGContextFlush(bitmap);
+	CGContextRelease(bitmap);
 	
 	// get non-premultiplied pixels
-	ctx = CGBitmapContextCreate(buf, width, height, 8, 4 * width, space, kCGImageAlphaNoneSkipFirst);
-	if (ctx == NULL) {
-		fprintf(stderr, "can't create bitmap context!\n");
-		free(buf);
+	bitmap = CGBitmapContextCreate(buf, width, height, 8, 4 * width, space, kCGImageAlphaNoneSkipFirst);
+	if (bitmap == NULL) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "can't create bitmap context");
+		MemFree(allocator, buf);
 		buf = NULL;
 	}
-	CGContextDrawImage(ctx, CGRectMake(0, 0, width, height), image);
-	CGContextFlush(ctx);
-	CGContextRelease(ctx);
+	CGContextDrawImage(bitmap, CGRectMake(0, 0, width, height), image);
+	CGContextFlush(bitmap);
+	CGContextRelease(bitmap);
 	
-	// compose
-	for (i = 0; i < width * height; i++) {
-		buf[i*4+0] = buf2[i*4+0];
+	// compose into the planes
+	if (buf && buf2 && ImageAlloc(planes, width, height, allocator) == 0) {
+		for (i = 0; i < width * height; i++) {
+			planes->planes[kImageA][i] = buf2[i*4+0];
+			planes->planes[kImageR][i] = buf[i*4+1];
+			planes->planes[kImageG][i] = buf[i*4+2];
+			planes->planes[kImageB][i] = buf[i*4+3];
+		}
+		r = 0;
 	}
 	
-	if (outwid)
-		*outwid = width;
-	if (outhei)
-		*outhei = height;
-	
-	free(buf2);
+	MemFree(allocator, buf);
+	MemFree(allocator, buf2);
 	CGColorSpaceRelease(space);
 	CGImageRelease(image);
 	CGDataProviderRelease(provider);
-	return buf;
+	return r;
 }
 
 #ifdef TEST
 
-void Dump(const void *data, long len)
-{
-	long i;
-	const UInt8 *p = data;
-	while (len > 0) {
-		long slen = 16;
-		if (len < slen)
-			slen = len;
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%02hhX ", p[i]);
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, "   ");
-		}
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%c", isprint(p[i]) ? p[i] : '.');
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, " ");
-		}
-		fputs("\n", stderr);
-		len -= slen;
-	}
-}
-
-void MakeRGBATIFF(const char *filename, void *data, int width, int height)
+static void MakeRGBATIFF(const char *filename, void *data, int width, int height)
 {
 	if (data == NULL) {
 		fprintf(stderr, "NULL tiff?\n");
@@ -190,48 +206,26 @@ int main(int argc, char *argv[])
 		if (fp) {
 			long sz;
 			char *buf;
-			char *buf2;
+			uint8_t *rgba;
 			char *buf3;
-			char *mask;
 			long size;
-			long wid, hei;
+			Image image;
+			int i;
 			fseek(fp, 0, SEEK_END);
 			sz = ftell(fp);
 			buf = malloc(sz);
 			rewind(fp);
 			fread(buf, 1, sz, fp);
-			Dump(buf, 16);
-			buf2 = ExpandPNG(buf, sz, &wid, &hei);
-			mask = malloc(wid * hei);
-			if (buf2) {
-				// ARGB->RGBA
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					mask[i] = buf2[i*4+0];
-					buf2[i*4+0] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+3];
-					buf2[i*4+3] = mask[i];
-				}
-			}
-			else {
-				fprintf(stderr, "ExpandPNG returned NULL\n");
+			if (ExpandPNG(buf, sz, NULL, &image, NULL) != 0) {
+				fprintf(stderr, "ExpandPNG failed\n");
 				free(buf);
-				free(mask);
 				return 1;
 			}
-			MakeRGBATIFF("test.tiff", buf2, wid, hei);
-			{
-				// back to ARGB
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					//mask[i] = buf2[i*4+3];
-					buf2[i*4+3] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+0];
-				}
-			}
-			buf3 = CompressToPNG(wid, hei, buf2, mask, &size);
+			rgba = malloc(4 * image.width * image.height);
+			for (i = 0; i < image.height; i++)
+				ImageGetRGBARow(&image, i, rgba + 4 * i * image.width);
+			MakeRGBATIFF("test.tiff", rgba, image.width, image.height);
+			buf3 = CompressToPNG(&image, NULL, &size, NULL);
 			fprintf(stderr, "%ld bytes PNG\n", size);
 			{
 				FILE *fp = fopen("test.png", "wb");
@@ -240,9 +234,9 @@ int main(int argc, char *argv[])
 				fclose(fp);
 			}
 			free(buf);
-			free(buf2);
+			free(rgba);
 			free(buf3);
-			free(mask);
+			ImageFree(&image, NULL);
 		}
 		fclose(fp);
 		return 0;
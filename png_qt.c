@@ -1,6 +1,7 @@
 #include <Carbon/Carbon.h>
 #include <QuickTime/QuickTime.h>
 #include "png.h"
+#include "arena.h"
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
@@ -17,8 +18,22 @@ extern pascal Ptr GetPixBaseAddr(PixMapHandle pm);
 #endif
 
 
-void * CompressToPNG(int width, int height, const void *rgb, const void *mask, long *outsize)
+void InitPNGCodec(void)
 {
+	// QuickTime components are opened per image
+}
+
+int PNGEncoderTakesOptions(void)
+{
+	return 0;
+}
+
+void * CompressToPNG(const Image *image, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
+{
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
+	int width = image->width;
+	int height = image->height;
+	UInt8 *argb;
 	OSErr err;
 	ComponentResult cr;
 	ComponentInstance ci;
@@ -31,20 +46,25 @@ void * CompressToPNG(int width, int height, const void *rgb, const void *mask, l
 	
 	err = OpenADefaultComponent(GraphicsExporterComponentType, kQTFileTypePNG, &ci);
 	if (err != noErr) {
-		fprintf(stderr, "can't load QuickTime PNG exporter (%d)\n", err);
+		LogMessage(ctx, kExe2ICNSLogWarning, "can't load QuickTime PNG exporter (%d)", err);
 		return nil;
 	}
 	
-	if (mask) {
-		for (i = 0; i < width * height; i++)
-			((char *)rgb)[i*4] = ((char *)mask)[i];	// ignoring const; should allocate new memory...
+	// the GWorld wants the pixels interleaved
+	argb = MemAlloc(allocator, 4 * width * height);
+	if (argb == nil) {
+		CloseComponent(ci);
+		return nil;
 	}
-	else {
-		// alpha?
+	for (i = 0; i < width * height; i++) {
+		argb[i*4+0] = image->planes[kImageA][i];
+		argb[i*4+1] = image->planes[kImageR][i];
+		argb[i*4+2] = image->planes[kImageG][i];
+		argb[i*4+3] = image->planes[kImageB][i];
 	}
 	
 	SetRect(&r, 0, 0, width, height);
-	err = NewGWorldFromPtr(&gw, k32ARGBPixelFormat, &r, nil, nil, 0, (Ptr)rgb, 4 * width);
+	err = NewGWorldFromPtr(&gw, k32ARGBPixelFormat, &r, nil, nil, 0, (Ptr)argb, 4 * width);
 	if (err == noErr) {
 		h = NewHandle(0);
 		cr = GraphicsExportSetInputGWorld(ci, gw);
@@ -54,27 +74,44 @@ void * CompressToPNG(int width, int height, const void *rgb, const void *mask, l
 			cr = GraphicsExportDoExport(ci, &size);
 		if (cr == noErr) {
 			//size = GetHandleSize(h);
-			buf = malloc(size);
-			BlockMoveData(*h, buf, size);
+			buf = MemAlloc(allocator, size);
+			if (buf)
+				BlockMoveData(*h, buf, size);
 			if (outsize)
 				*outsize = size;
 		}
 		else {
-			fprintf(stderr, "export to PNG failed (%d)\n", (int)cr);
+			LogMessage(ctx, kExe2ICNSLogWarning, "export to PNG failed (%d)", (int)cr);
 		}
 	
 		DisposeHandle(h);
 		DisposeGWorld(gw);
 	}
 	else {
-		fprintf(stderr, "NewGWorldFromPtr %d\n", err);
+		LogMessage(ctx, kExe2ICNSLogWarning, "NewGWorldFromPtr %d", err);
 	}
 	CloseComponent(ci);
+	MemFree(allocator, argb);
 	return buf;
 }
 
-void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
+// the system encoder wants the whole image anyway
+void * CompressRowsToPNG(int width, int height, PNGRowsFunc rows, void *rowsctx, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
 {
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
+	Image image;
+	void *buf;
+	if (ImageAlloc(&image, width, height, allocator) != 0)
+		return NULL;
+	rows(rowsctx, 0, &image);
+	buf = CompressToPNG(&image, options, outsize, ctx);
+	ImageFree(&image, allocator);
+	return buf;
+}
+
+int ExpandPNG(const void *png, long pngsize, const PNGDecodeOptions *options, Image *image, const Exe2ICNSContext *ctx)
+{
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
 	OSErr err;
 	ComponentResult cr;
 	ComponentInstance ci;
@@ -84,12 +121,12 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 	UInt8 *buf;
 	GWorldPtr gw;
 	int i;
-	Boolean rotate = false;
+	int result = -1;
 	
 	err = OpenADefaultComponent(GraphicsImporterComponentType, kQTFileTypePNG, &ci);
 	if (err != noErr) {
-		fprintf(stderr, "can't load QuickTime PNG importer (%d)\n", err);
-		return nil;
+		LogMessage(ctx, kExe2ICNSLogWarning, "can't load QuickTime PNG importer (%d)", err);
+		return -1;
 	}
 	
 	h = NewHandle(0);
@@ -102,7 +139,7 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 	//cr = GraphicsImportCreateCGImage(ci, &cgimg, kGraphicsImportCreateCGImageUsingCurrentSettings);	// needs 10.3 and QT 6.4
 	wid = r.right - r.left;
 	hei = r.bottom - r.top;
-	buf = malloc(4 * wid * hei);
+	buf = MemAlloc(allocator, 4 * wid * hei);
 	err = QTNewGWorldFromPtr(&gw, k32ARGBPixelFormat, &r, nil, nil, 0, (Ptr)buf, 4 * wid);
 	if (err == noErr) {
 		cr = GraphicsImportSetGWorld(ci, gw, nil);
@@ -111,68 +148,39 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 		if (cr == noErr) {
 		}
 		else {
-			fprintf(stderr, "GraphicsImportSetGWorld/Draw %d\n", (int)cr);
-			free(buf);
+			LogMessage(ctx, kExe2ICNSLogWarning, "GraphicsImportSetGWorld/Draw %d", (int)cr);
+			MemFree(allocator, buf);
 			buf = nil;
 		}
 	
 		DisposeGWorld(gw);
 	}
 	else {
-		free(buf);
-		fprintf(stderr, "NewGWorldFromPtr %d\n", err);
+		MemFree(allocator, buf);
+		LogMessage(ctx, kExe2ICNSLogWarning, "NewGWorldFromPtr %d", err);
 		buf = nil;
 	}
 	
-	if (outwid)
-		*outwid = wid;
-	if (outhei)
-		*outhei = hei;
-	
-	if (rotate) {
-		// ARGB -> RGBA
+	// ARGB -> planes
+	if (buf && ImageAlloc(image, wid, hei, allocator) == 0) {
 		for (i = 0; i < wid * hei; i++) {
-			UInt8 a = buf[4*i];
-			buf[4*i] = buf[4*i+1];
-			buf[4*i+1] = buf[4*i+2];
-			buf[4*i+2] = buf[4*i+3];
-			buf[4*i+3] = a;
+			image->planes[kImageA][i] = buf[4*i];
+			image->planes[kImageR][i] = buf[4*i+1];
+			image->planes[kImageG][i] = buf[4*i+2];
+			image->planes[kImageB][i] = buf[4*i+3];
 		}
+		result = 0;
 	}
 	
+	MemFree(allocator, buf);
 	DisposeHandle(h);
 	CloseComponent(ci);
-	return buf;
+	return result;
 }
 
 #ifdef TEST
 
-void Dump(const void *data, long len)
-{
-	long i;
-	const UInt8 *p = data;
-	while (len > 0) {
-		long slen = 16;
-		if (len < slen)
-			slen = len;
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%02hhX ", p[i]);
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, "   ");
-		}
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%c", isprint(p[i]) ? p[i] : '.');
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, " ");
-		}
-		fputs("\n", stderr);
-		len -= slen;
-	}
-}
-
-void MakeRGBATIFF(const char *filename, void *data, int width, int height)
+static void MakeRGBATIFF(const char *filename, void *data, int width, int height)
 {
 	if (data == NULL) {
 		fprintf(stderr, "NULL tiff?\n");
@@ -235,48 +243,26 @@ int main(int argc, char *argv[])
 		if (fp) {
 			long sz;
 			char *buf;
-			char *buf2;
+			uint8_t *rgba;
 			char *buf3;
-			char *mask;
 			long size;
-			long wid, hei;
+			Image image;
+			int i;
 			fseek(fp, 0, SEEK_END);
 			sz = ftell(fp);
 			buf = malloc(sz);
 			rewind(fp);
 			fread(buf, 1, sz, fp);
-			Dump(buf, 16);
-			buf2 = ExpandPNG(buf, sz, &wid, &hei);
-			mask = malloc(wid * hei);
-			if (buf2) {
-				// ARGB->RGBA
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					mask[i] = buf2[i*4+0];
-					buf2[i*4+0] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+3];
-					buf2[i*4+3] = mask[i];
-				}
-			}
-			else {
-				fprintf(stderr, "ExpandPNG returned NULL\n");
+			if (ExpandPNG(buf, sz, NULL, &image, NULL) != 0) {
+				fprintf(stderr, "ExpandPNG failed\n");
 				free(buf);
-				free(mask);
 				return 1;
 			}
-			MakeRGBATIFF("test.tiff", buf2, wid, hei);
-			{
-				// back to ARGB
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					//mask[i] = buf2[i*4+3];
-					buf2[i*4+3] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+0];
-				}
-			}
-			buf3 = CompressToPNG(wid, hei, buf2, mask, &size);
+			rgba = malloc(4 * image.width * image.height);
+			for (i = 0; i < image.height; i++)
+				ImageGetRGBARow(&image, i, rgba + 4 * i * image.width);
+			MakeRGBATIFF("test.tiff", rgba, image.width, image.height);
+			buf3 = CompressToPNG(&image, NULL, &size, NULL);
 			fprintf(stderr, "%ld bytes PNG\n", size);
 			{
 				FILE *fp = fopen("test.png", "wb");
@@ -285,9 +271,9 @@ int main(int argc, char *argv[])
 				fclose(fp);
 			}
 			free(buf);
-			free(buf2);
+			free(rgba);
 			free(buf3);
-			free(mask);
+			ImageFree(&image, NULL);
 		}
 		fclose(fp);
 		return 0;
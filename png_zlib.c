@@ -2,13 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <ctype.h>
 #include <stdint.h>
 #include <zlib.h>
 #include "png.h"
+#include "arena.h"
 
-#ifdef TEST
-void Dump(const void *data, long len);
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PNG_USE_SSE2 1
 #endif
 
 typedef signed char boolean;
@@ -24,7 +25,7 @@ static uint32_t Get32(const void *mem, long off)
 {
 	const uint8_t *p = mem;
 	p += off;
-	return p[0] * 16777216 + p[1] * 65536 + p[2] * 256 + p[3];
+	return p[0] * 16777216U + p[1] * 65536 + p[2] * 256 + p[3];
 }
 static void Put8(void *mem, long off, uint8_t value)
 {
@@ -48,296 +49,347 @@ static void Put32(void *mem, long off, uint32_t value)
 	p[3] = value;
 }
 
-uint32_t gCRCTable[256];
-#define kCRCPoly	0xEDB88320
+int PNGEncoderTakesOptions(void)
+{
+	return 1;
+}
 
-void MakeCRCTable(void)
+void InitPNGCodec(void)
 {
-	int v;
-	uint32_t *table = gCRCTable;
-	if (table[1] == 0) {
-		// table is uninitialized
-		table[0] = 0;
-		for (v = 1; v < 256; v++) {
-			uint32_t r = v;
-			int i;
-			for (i = 0; i < 8; i++) {
-				if (r & 1) {
-					r >>= 1;
-					r ^= kCRCPoly;
-				}
-				else
-					r >>= 1;
-			}
-			table[v] = r;
-		}
-	}
+	// nothing to prepare; zlib's crc tables are constant
 }
 
-uint32_t UpdateCRC(uint32_t crc, const void *mem, long len)
+// crc of a chunk's type and data; zlib's crc32 works a word at a time from constant tables
+static uint32_t ChunkCRC(const void *mem, long len)
 {
-	uint32_t r = crc;
-	const uint8_t *p = mem;
-	const uint32_t *table = gCRCTable;
-	while (len-- != 0) {
-		uint8_t v = *p++;
-		r = (r >> 8) ^ table[v ^ (r & 255)];
-	}
-	return r;
+	return crc32(0, mem, len);
 }
 
-static void * DeflateAllAtOnce(const void *data, unsigned long size, unsigned long *outsize)
+// zlib's own state comes from the same allocator as everything else
+static voidpf ZAlloc(voidpf opaque, uInt items, uInt size)
 {
-	z_stream z;
-	int zr;
-	unsigned long zbound;
-	unsigned long zchunksize = 16384;
-	long zbufsize;
-	uint8_t *zbuf;
-	
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
-	
-	//zr = deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY);
-	zr = deflateInit(&z, Z_BEST_COMPRESSION);
-	if (zr != Z_OK) {
-		fprintf(stderr, "zlib deflateInit error: %s\n", z.msg);
-		return NULL;
-	}
-	zbound = deflateBound(&z, size);
-	
-	zbufsize = (zbound + zchunksize - 1) / zchunksize * zchunksize;
-	zbuf = malloc(zbufsize);
-	z.next_in = data;
-	z.avail_in = size;
-	z.next_out = zbuf;
-	z.avail_out = zbufsize;
-	
-	do {
-		zr = deflate(&z, Z_FINISH);
-		if (zr == Z_STREAM_END)
+	return MemAlloc(opaque, (size_t)items * size);
+}
+
+static void ZFree(voidpf opaque, voidpf address)
+{
+	MemFree(opaque, address);
+}
+
+enum {
+	kBandBytes = 32768	// scanlines made and deflated at a time, so that they're still in the cache when deflate reads them
+};
+
+enum {
+	kFilterNone,
+	kFilterSub,
+	kFilterUp,
+	kFilterAverage,
+	kFilterPaeth,
+	kFilterTypes
+};
+
+static int Paeth(int a, int b, int c)
+{
+	int pa, pb, pc;
+	pa = abs(b - c);
+	pb = abs(a - c);
+	pc = abs(a + b - 2 * c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+#if PNG_USE_SSE2
+static __m128i Abs16(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Paeth of 8 pixel bytes zero-extended to 16 bits
+static __m128i PaethHalf(__m128i a, __m128i b, __m128i c)
+{
+	__m128i pa = _mm_sub_epi16(b, c);
+	__m128i pb = _mm_sub_epi16(a, c);
+	__m128i pc = Abs16(_mm_add_epi16(pa, pb));
+	__m128i nota, notb, bc;
+	pa = Abs16(pa);
+	pb = Abs16(pb);
+	// a if pa <= pb and pa <= pc, else b if pb <= pc, else c
+	nota = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	notb = _mm_cmpgt_epi16(pb, pc);
+	bc = _mm_or_si128(_mm_and_si128(notb, c), _mm_andnot_si128(notb, b));
+	return _mm_or_si128(_mm_and_si128(nota, bc), _mm_andnot_si128(nota, a));
+}
+
+static __m128i PaethPredict(__m128i a, __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = PaethHalf(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+	__m128i hi = PaethHalf(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+	return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+// filter n bytes of a row of 4-byte pixels into out with the given filter type; prev is the row above
+// both rows have 4 zero bytes in front of them, so the first pixel needs no special case
+// returns the sum of the filtered bytes as signed magnitudes, which is what the filter is chosen by
+static long FilterRow(int type, const uint8_t *row, const uint8_t *prev, long n, uint8_t *out)
+{
+	long i = 0;
+	long sum = 0;
+#if PNG_USE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i acc = zero;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i *)(row + i - 4));
+		__m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+		__m128i f;
+		switch (type) {
+		default:
+		case kFilterNone:
+			f = x;
+			break;
+		case kFilterSub:
+			f = _mm_sub_epi8(x, a);
+			break;
+		case kFilterUp:
+			f = _mm_sub_epi8(x, b);
+			break;
+		case kFilterAverage:
+			// pavgb rounds up; take away the bit it added when a + b is odd
+			f = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+			break;
+		case kFilterPaeth:
+			f = _mm_sub_epi8(x, PaethPredict(a, b, _mm_loadu_si128((const __m128i *)(prev + i - 4))));
 			break;
-		else if (zr == Z_OK) {
-			// continue
-			if (z.avail_out == 0) {
-				uint8_t *p = realloc(zbuf, zbufsize + zchunksize);
-				if (p) {
-					zbuf = p;
-					z.next_out = zbuf + zbufsize;
-					zbufsize += zchunksize;
-					z.avail_out = zchunksize;
-				}
-				else {
-					fprintf(stderr, "DeflateAll: no memory\n");
-					free(zbuf);
-					zbuf = NULL;
-					break;
-				}
-			}
 		}
-		else {
-			// error
-			fprintf(stderr, "zlib deflate error: %s\n", z.msg);
-			free(zbuf);
-			zbuf = NULL;
+		_mm_storeu_si128((__m128i *)(out + i), f);
+		// |f| is the smaller of f and -f as unsigned bytes
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(f, _mm_sub_epi8(zero, f)), zero));
+	}
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+	for (; i < n; i++) {
+		int a = row[i - 4];
+		int b = prev[i];
+		uint8_t f;
+		switch (type) {
+		default:
+		case kFilterNone:
+			f = row[i];
+			break;
+		case kFilterSub:
+			f = row[i] - a;
+			break;
+		case kFilterUp:
+			f = row[i] - b;
+			break;
+		case kFilterAverage:
+			f = row[i] - (a + b) / 2;
+			break;
+		case kFilterPaeth:
+			f = row[i] - Paeth(a, b, prev[i - 4]);
 			break;
 		}
-	} while (1);
-	
-	if (zbuf && outsize)
-		*outsize = z.total_out;
-	
-	deflateEnd(&z);
-	
-	return zbuf;
+		out[i] = f;
+		sum += f < 128 ? f : 256 - f;
+	}
+	return sum;
 }
 
-static void * InflateAllAtOnce(const void *data, unsigned long size, unsigned long expectedsize, unsigned long *outsize)
+// rows of the previous band are needed to filter the next one, so these live as long as the image
+struct RowFilter_ {
+	long n;	// bytes per row, without the filter type
+	uint8_t *prev;	// the row above, unfiltered; zeros above the first row
+	uint8_t *cur;
+	uint8_t *trial;	// a filter being tried
+};
+typedef struct RowFilter_ RowFilter;
+
+// rows -> scanlines -> the deflate stream
+// adaptive filtering gives each row the filter with the smallest sum of absolute differences
+// z has room for all the output (deflateBound), so deflate takes all of the input at once
+static int DeflateRows(z_stream *z, const Image *rows, int filtertype, RowFilter *filter, uint8_t *scanlines, const Exe2ICNSContext *ctx)
 {
-	z_stream z;
-	int zr;
-	unsigned long zchunksize = 16384;
-	long zbufsize;
-	uint8_t *zbuf;
-	
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
-	
-	zr = inflateInit(&z);
-	if (zr != Z_OK) {
-		fprintf(stderr, "zlib inflateInit error: %s\n", z.msg);
-		return NULL;
-	}
-	
-	zbufsize = (expectedsize + zchunksize - 1) / zchunksize * zchunksize;
-	zbuf = malloc(zbufsize);
-	z.next_in = data;
-	z.avail_in = size;
-	z.next_out = zbuf;
-	z.avail_out = zbufsize;
-	
-	do {
-		zr = inflate(&z, Z_NO_FLUSH);
-		if (zr == Z_STREAM_END)
-			break;
-		else if (zr == Z_OK) {
-			// continue
-			if (z.avail_out == 0) {
-				uint8_t *p = realloc(zbuf, zbufsize + zchunksize);
-				if (p) {
-					zbuf = p;
-					z.next_out = zbuf + zbufsize;
-					zbufsize += zchunksize;
-					z.avail_out = zchunksize;
-				}
-				else {
-					fprintf(stderr, "InflateAll: no memory\n");
-					free(zbuf);
-					zbuf = NULL;
-					break;
-				}
-			}
+	long n = filter->n;
+	int i, type;
+	for (i = 0; i < rows->height; i++) {
+		uint8_t *line = scanlines + i * (n + 1);
+		uint8_t *swap;
+		long best;
+		ImageGetRGBARow(rows, i, filter->cur);
+		if (filtertype != kPNGFilterAdaptive) {
+			line[0] = filtertype;
+			FilterRow(filtertype, filter->cur, filter->prev, n, line + 1);
 		}
 		else {
-			// error
-			fprintf(stderr, "zlib inflate error: %s\n", z.msg);
-			free(zbuf);
-			zbuf = NULL;
-			break;
+			line[0] = kFilterNone;
+			best = FilterRow(kFilterNone, filter->cur, filter->prev, n, line + 1);
 		}
-	} while (1);
-	
-	if (zbuf && outsize)
-		*outsize = z.total_out;
-	
-	inflateEnd(&z);
-	
-	return zbuf;
+		for (type = kFilterSub; filtertype == kPNGFilterAdaptive && type < kFilterTypes; type++) {
+			long sum = FilterRow(type, filter->cur, filter->prev, n, filter->trial);
+			if (sum < best) {
+				best = sum;
+				line[0] = type;
+				memcpy(line + 1, filter->trial, n);
+			}
+		}
+		swap = filter->prev;
+		filter->prev = filter->cur;
+		filter->cur = swap;
+	}
+	z->next_in = scanlines;
+	z->avail_in = (n + 1) * rows->height;
+	if (deflate(z, Z_NO_FLUSH) != Z_OK || z->avail_in != 0) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "zlib deflate error: %s", z->msg ? z->msg : "output full");
+		return -1;
+	}
+	return 0;
 }
 
-/* make simple PNG with no interlace, zero filter */
-void * CompressToPNG(int width, int height, const void *rgb, const void *mask, long *outsize)
+// Z_FILTERED suits the adaptively filtered rows, which are mostly small values
+static const PNGOptions kDefaultOptions = {kPNGFilterAdaptive, Z_BEST_COMPRESSION, 8, kPNGStrategyFiltered};
+
+/* make simple PNG with no interlace */
+// the rows are taken from image, or from rows one band at a time if image is NULL
+static void * EncodePNG(int width, int height, const Image *image, PNGRowsFunc rows, void *rowsctx, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
 {
-	char pngsig[8] = "\x89PNG\15\12\32\12";
-	char ihdr[25];
-	char idathdr[8] = "\0\0\0\0IDAT";
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
+	static const int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE};
+	const char pngsig[8] = "\x89PNG\15\12\32\12";
 	char iend[12] = "\0\0\0\0IEND\0\0\0\0";
-	uint32_t crc;
-	const uint8_t *rgbp = rgb;
-	const uint8_t *maskp = mask;
-	uint8_t *buf;
-	long usize;
-	uint8_t *zbuf;
-	unsigned long zsize;
-	char idatcrc[4];
-	uint8_t *pngbuf;
-	unsigned long pngsize;
-	
-	MakeCRCTable();
+	long rowbytes = 1 + 4 * (long)width;
+	int bandrows = kBandBytes / rowbytes > 0 ? kBandBytes / rowbytes : 1;
+	uint8_t *scanlines;
+	RowFilter filter;
+	Image band;
+	z_stream z;
+	unsigned long zbound;
+	uint8_t *pngbuf = NULL;
+	uint8_t *idat = NULL;
+	long pngsize;
+	int first;
+	int r = 0;
+	
+	if (options == NULL)
+		options = &kDefaultOptions;
+	if (bandrows > height)
+		bandrows = height;
+	memset(&band, 0, sizeof(Image));
+	// one band of scanlines, then the filter rows: prev and cur with 4 zero bytes in front, and trial
+	scanlines = MemAlloc(allocator, rowbytes * bandrows + 3 * rowbytes + 8);
+	if (scanlines == NULL || (image == NULL && ImageAlloc(&band, width, bandrows, allocator) != 0)) {
+		MemFree(allocator, scanlines);
+		return NULL;
+	}
+	filter.n = rowbytes - 1;
+	filter.prev = scanlines + rowbytes * bandrows + 4;
+	filter.cur = filter.prev + rowbytes + 4;
+	filter.trial = filter.cur + rowbytes;
+	memset(filter.prev - 4, 0, 2 * rowbytes + 8);
+	
+	z.zalloc = ZAlloc;
+	z.zfree = ZFree;
+	z.opaque = (voidpf)allocator;
+	if (deflateInit2(&z, options->level, Z_DEFLATED, 15, options->memlevel, strategies[options->strategy]) != Z_OK) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "zlib deflateInit error: %s", z.msg);
+		MemFree(allocator, scanlines);
+		ImageFree(&band, allocator);
+		return NULL;
+	}
 	
-	// construct IHDR
-	memmove(ihdr, "\0\0\0\15IHDR", 8);
-	Put32(ihdr, 8, width);
-	Put32(ihdr, 12, height);
-	ihdr[16] = 8;	// depth
-	if (mask)
-		ihdr[17] = 6;	// colour type : Truecolour
-	else
-		ihdr[17] = 2;
-	ihdr[18] = 0;	// compression method : deflate
-	ihdr[19] = 0;	// filter method
-	ihdr[20] = 0;	// interlace : none
-	crc = UpdateCRC(-1, &ihdr[4], 17);
-	Put32(ihdr, 21, ~ crc);
+	// the whole png is made in place: signature, IHDR, IDAT header, the deflate stream, IDAT crc, IEND
+	zbound = deflateBound(&z, rowbytes * height);
+	pngbuf = MemAlloc(allocator, 8 + 25 + 8 + zbound + 4 + 12);
+	if (pngbuf == NULL)
+		r = -1;
+	else {
+		uint8_t *ihdr = pngbuf + 8;
+		memmove(pngbuf, pngsig, 8);
+		memmove(ihdr, "\0\0\0\15IHDR", 8);
+		Put32(ihdr, 8, width);
+		Put32(ihdr, 12, height);
+		ihdr[16] = 8;	// depth
+		ihdr[17] = 6;	// colour type : Truecolour with alpha
+		ihdr[18] = 0;	// compression method : deflate
+		ihdr[19] = 0;	// filter method
+		ihdr[20] = 0;	// interlace : none
+		Put32(ihdr, 21, ChunkCRC(&ihdr[4], 17));
+		idat = pngbuf + 33;
+		memmove(idat, "\0\0\0\0IDAT", 8);
+		z.next_out = idat + 8;
+		z.avail_out = zbound;
+	}
 	
-	// reorder pixel data
-	if (mask) {
-		int i, j;
-		uint8_t *row;
-		usize = (1 + 4 * width) * height;
-		buf = malloc(usize);
-		row = buf;
-		for (i = 0; i < height; i++) {
-			row[0] = 0;
-			for (j = 0; j < width; j++) {
-				row[j*4+1] = rgbp[(i*width+j)*4+1];
-				row[j*4+2] = rgbp[(i*width+j)*4+2];
-				row[j*4+3] = rgbp[(i*width+j)*4+3];
-				row[j*4+4] = maskp[i*width+j];
-			}
-			row += 4 * width + 1;
+	for (first = 0; r == 0 && first < height; first += bandrows) {
+		int count = height - first < bandrows ? height - first : bandrows;
+		if (image) {
+			// a view of the rows where they are
+			int c;
+			band = *image;
+			for (c = 0; c < kImagePlanes; c++)
+				band.planes[c] += (long)first * width;
 		}
+		band.height = count;
+		if (image == NULL)
+			rows(rowsctx, first, &band);
+		r = DeflateRows(&z, &band, options->filter, &filter, scanlines, ctx);
 	}
-	else {
-		int i, j;
-		uint8_t *row;
-		usize = (1 + 3 * width) * height;
-		buf = malloc(usize);
-		row = buf;
-		for (i = 0; i < height; i++) {
-			row[0] = 0;
-			for (j = 0; j < width; j++) {
-				row[j*3+1] = rgbp[(i*width+j)*4+1];
-				row[j*3+2] = rgbp[(i*width+j)*4+2];
-				row[j*3+3] = rgbp[(i*width+j)*4+3];
-			}
-			row += 3 * width + 1;
-		}
+	if (r == 0 && deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "zlib deflate error: %s", z.msg ? z.msg : "output full");
+		r = -1;
 	}
 	
-	// construct IDAT
-	zbuf = DeflateAllAtOnce(buf, usize, &zsize);
-	if (zbuf == NULL) {
-		free(buf);
-		return NULL;
+	if (r == 0) {
+		long zsize = z.total_out;
+		Put32(idat, 0, zsize);
+		Put32(idat, 8 + zsize, ChunkCRC(idat + 4, 4 + zsize));
+		Put32(iend, 8, ChunkCRC("IEND", 4));
+		memmove(idat + 12 + zsize, iend, 12);
+		pngsize = idat + 24 + zsize - pngbuf;
+		if (outsize)
+			*outsize = pngsize;
+	}
+	else {
+		MemFree(allocator, pngbuf);
+		pngbuf = NULL;
 	}
-	Put32(idathdr, 0, zsize);
-	memmove(&idathdr[4], "IDAT", 4);
-	crc = UpdateCRC(-1, &idathdr[4], 4);
-	crc = UpdateCRC(crc, zbuf, zsize);
-	Put32(idatcrc, 0, ~ crc);
-	
-	// IEND
-	crc = UpdateCRC(-1, "IEND", 4);
-	Put32(iend, 8, ~ crc);
-	
-	// make png stream
-	pngsize = 8;	// signature
-	pngsize += 25;	// IHDR
-	pngsize += 12;	// IDAT header & crc
-	pngsize += zsize;
-	pngsize += 12;	// IEND
-	pngbuf = malloc(pngsize);
-	memmove(&pngbuf[0], pngsig, 8);
-	memmove(&pngbuf[8], ihdr, 25);
-	memmove(&pngbuf[33], idathdr, 8);
-	memmove(&pngbuf[41], zbuf, zsize);
-	memmove(&pngbuf[41+zsize], idatcrc, 4);
-	memmove(&pngbuf[45+zsize], iend, 12);
-	
-	free(buf);
-	free(zbuf);
-	
-	if (outsize)
-		*outsize = pngsize;
 	
+	deflateEnd(&z);
+	MemFree(allocator, scanlines);
+	if (image == NULL)
+		ImageFree(&band, allocator);
 	return pngbuf;
 }
 
+void * CompressToPNG(const Image *image, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
+{
+	return EncodePNG(image->width, image->height, image, NULL, NULL, options, outsize, ctx);
+}
+
+void * CompressRowsToPNG(int width, int height, PNGRowsFunc rows, void *rowsctx, const PNGOptions *options, long *outsize, const Exe2ICNSContext *ctx)
+{
+	return EncodePNG(width, height, NULL, rows, rowsctx, options, outsize, ctx);
+}
+
 
 
-static boolean CheckCRC(const void *chunk)
+static boolean CheckCRC(const void *chunk, const Exe2ICNSContext *ctx)
 {
 	const uint8_t *p = chunk;
 	long size = Get32(p, 0);
 	uint32_t crc;
-	crc = UpdateCRC(-1, p + 4, size + 4);
-	if (Get32(p, 8 + size) == ~ crc) 
+	crc = ChunkCRC(p + 4, size + 4);
+	if (Get32(p, 8 + size) == crc) 
 		return 1;
 	else {
-		fprintf(stderr, "CRC mismatch on %.4s (%08X): %08X calculated, %08X found\n", p + 4, Get32(p, 4), ~ crc, Get32(p, 8 + size));
+		LogMessage(ctx, kExe2ICNSLogWarning, "png crc mismatch on %.4s: %08X calculated, %08X found", p + 4, crc, Get32(p, 8 + size));
 		return 0;
 	}
 }
@@ -384,103 +436,67 @@ static int PNGNComponents(int colourtype)
 	return ncomp;
 }
 
-static int Paeth(int a, int b, int c)
+// undo the filter of one scanline in place; row[0] is the filter type, then rowbytes bytes
+// prev is the unfiltered row above in the same layout, all zeros for the first row of a pass
+// bpp is bytes per pixel, rounded up to 1 for depths under 8
+static void UnfilterRow(uint8_t *row, const uint8_t *prev, long rowbytes, int bpp)
 {
-	int pa, pb, pc;
-	pa = abs(b - c);
-	pb = abs(a - c);
-	pc = abs(a + b - 2 * c);
-	if (pa <= pb && pa <= pc)
-		return a;
-	else if (pb <= pc)
-		return b;
-	else
-		return c;
+	int filtertype = row[0];
+	long j;
+	row[0] = 0;	// so that the pixel to the left of the first one reads as 0 when bpp is 1
+	for (j = 1; j <= rowbytes; j++) {
+		int a = j < bpp ? 0 : row[j-bpp];
+		int b = prev[j];
+		int c = j < bpp ? 0 : prev[j-bpp];
+		switch (filtertype) {
+		default:
+		case 0:
+			// do nothing
+			break;
+		case 1:	// sub
+			row[j] += a;
+			break;
+		case 2:	// up
+			row[j] += b;
+			break;
+		case 3:	// average
+			row[j] += (a + b) / 2;
+			break;
+		case 4:	// paeth
+			row[j] += Paeth(a, b, c);
+			break;
+		}
+	}
 }
 
-static void Unfilter(uint8_t *image, long width, long height, int depth, int ncomp)
-{
-	int i, j, k;
-	long rowbytes = (ncomp * depth * width + 7) / 8;
-	uint8_t *zero = calloc(1, rowbytes + 1);
-	uint8_t *row = image;
-	uint8_t *lastrow = zero;
-	unsigned char filtertype;
-	for (i = 0; i < height; i++) {
-		filtertype = row[0];
-		row[0] = 0;
-		//fprintf(stderr, "%d: filter %d\n", i, filtertype);
-		if (depth < 8) {
-			// byte-by-byte filter
-			// ok to access row[j-1] because row[0] is now 0
-			for (j = 1; j <= rowbytes; j++) {
-				switch (filtertype) {
-				default:
-				case 0:
-					// do nothing
-					break;
-				case 1:	// sub
-					row[j] += row[j-1];
-					break;
-				case 2:	// up
-					row[j] += lastrow[j];
-					break;
-				case 3:	// average
-					row[j] += ((int)row[j-1] + (int)lastrow[j]) / 2;
-					break;
-				case 4:	// paeth
-					row[j] += Paeth(row[j-1], lastrow[j], lastrow[j-1]);
-					break;
-				}
-			}
-		}
-		else {
-			// byte-by-byte filter with pixel-size offset
-			int nb = (depth + 7) / 8;
-			int bpp = nb * ncomp;
-			for (j = 1; j <= rowbytes; j++) {
-				int a;
-				int b;
-				int c;
-				a = j < bpp ? 0 : row[j-bpp];
-				b = lastrow[j];
-				c = j < bpp ? 0 : lastrow[j-bpp];
-				switch (filtertype) {
-				default:
-				case 0:
-					// do nothing
-					break;
-				case 1:	// sub
-					row[j] += a;
-					break;
-				case 2:	// up
-					row[j] += b;
-					break;
-				case 3:	// average
-					row[j] += (a + b) / 2;
-					break;
-				case 4:	// paeth
-					row[j] += Paeth(a, b, c);
-					break;
-				}
-			}
-		}
-		lastrow = row;
-		row += rowbytes + 1;
+// the palette index or grey level that bKGD says is transparent, or -1
+static int BackgroundPixel(const uint8_t *bkgd, int pngcolourtype)
+{
+	if (bkgd == NULL)
+		return -1;
+	switch (pngcolourtype) {
+	case 0:
+	case 4:
+		// unsupported
+		return Get16(bkgd, 8);
+	case 3:
+		return bkgd[8];
+	default:
+		// unsupported
+		return -1;
 	}
-	free(zero);
 }
 
-static long ToARGB(void *pngimage, long width, long height, int pngdepth, int pngcolourtype, const void *pltechunk, const void *bkgdchunk, void *dest, long destwid, int hstart, int vstart, int hshift, int vshift)
+// spread the width pixels of an unfiltered scanline over row y of the planes of dest,
+// every (1 << hshift)th pixel from hstart on (the pixels of an adam7 pass)
+static void ConvertRow(const uint8_t *row, long width, int pngdepth, int pngcolourtype, const uint8_t *plte, int bgpix, Image *dest, long y, int hstart, int hshift)
 {
-	long i, j;
-	uint8_t *stream = pngimage;
-	uint8_t *argb = dest;
-	const uint8_t *bkgd = bkgdchunk;
-	const uint8_t *plte = pltechunk;
-	int ncomp = PNGNComponents(pngcolourtype);
-	long rowbytes = (pngdepth * ncomp * width + 7) / 8;
-	uint8_t *row;
+	long j;
+	long off = y * dest->width;
+	uint8_t *r = dest->planes[kImageR] + off;
+	uint8_t *g = dest->planes[kImageG] + off;
+	uint8_t *b = dest->planes[kImageB] + off;
+	uint8_t *a = dest->planes[kImageA] + off;
 	// for depth <= 8
 	int cpb = 8 / pngdepth;	// components per byte
 	int mask = (1 << pngdepth) - 1;
@@ -488,134 +504,212 @@ static long ToARGB(void *pngimage, long width, long height, int pngdepth, int pn
 	// for depth > 8
 	int nb = (pngdepth + 7) / 8;	// something like 12-bit format is padded
 	double div = ((1 << pngdepth) - 1) / 255.0;
-	int bgpix = -1;
 	
-	Unfilter(stream, width, height, pngdepth, ncomp);
-	if (bkgd) {
-		switch (pngcolourtype) {
-		case 0:
-		case 4:
-			// unsupported
-			bgpix = Get16(bkgd, 8);
-			break;
-		case 3:
-			bgpix = bkgd[8];
-			break;
-		case 2:
-		case 6:
-			// unsupported
-			break;
-		}
+	if (pngdepth == 8 && pngcolourtype == 6 && hshift == 0) {
+		// a whole row of RGBA, which is what the icons mostly are
+		ImageSetRGBARow(dest, y, row + 1);
+		return;
 	}
-	row = stream;
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j++) {
-			int pix;
-			int alpha;
-			int xb;
-			//long pindex = (i*destwid<<vshift)+(j<<hshift);
-			long pindex = ((i<<vshift)+vstart)*destwid+(j<<hshift)+hstart;
-			//fprintf(stderr, "%d %d\n", i << vshift, j << hshift);
-			//fprintf(stderr, "%ld %ld\n", (i << vshift) + vstart, (j << hshift) + hstart);
-			if (pngdepth <= 8) {
-				switch (pngcolourtype) {
-				case 0:
-					// grey
-					pix = ((row[1 + j / cpb]) >> (cpb - 1 - (j % cpb)) * pngdepth) & mask;
-					xb = pix * mult;	
-					argb[4*pindex+0] = 255;
-					argb[4*pindex+1] = xb;
-					argb[4*pindex+2] = xb;
-					argb[4*pindex+3] = xb;
-					break;
-				case 3:
-					// indexed
-					pix = ((row[1 + j / cpb]) >> (cpb - 1 - (j % cpb)) * pngdepth) & mask;
-					argb[4*pindex+0] = bkgd && pix == bgpix ? 0 : 255;
-					argb[4*pindex+1] = plte[8+3*pix];
-					argb[4*pindex+2] = plte[8+3*pix+1];
-					argb[4*pindex+3] = plte[8+3*pix+2];
-					break;
-				case 4:
-					// greyalpha
-					// assume pngdepth = 8
-					pix = row[1 + 2 * j];
-					xb = pix;
-					alpha = row[1 + 2 * j + 1];
-					argb[4*pindex+0] = alpha;
-					argb[4*pindex+1] = xb;
-					argb[4*pindex+2] = xb;
-					argb[4*pindex+3] = xb;
-					break;
-				case 2:
-					// RGB
-					// assume pngdepth = 8
-					argb[4*pindex+0] = 255;
-					argb[4*pindex+1] = row[1+3*j];
-					argb[4*pindex+2] = row[1+3*j+1];
-					argb[4*pindex+3] = row[1+3*j+2];
-					break;
-				case 6:
-					// RGBA
-					// assume pngdepth = 8
-					argb[4*pindex+0] = row[1+4*j+3];
-					argb[4*pindex+1] = row[1+4*j];
-					argb[4*pindex+2] = row[1+4*j+1];
-					argb[4*pindex+3] = row[1+4*j+2];
-					break;
-				}
+	for (j = 0; j < width; j++) {
+		int pix;
+		int alpha;
+		int xb;
+		long pindex = (j<<hshift)+hstart;
+		if (pngdepth <= 8) {
+			switch (pngcolourtype) {
+			case 0:
+				// grey
+				pix = ((row[1 + j / cpb]) >> (cpb - 1 - (j % cpb)) * pngdepth) & mask;
+				xb = pix * mult;	
+				a[pindex] = 255;
+				r[pindex] = xb;
+				g[pindex] = xb;
+				b[pindex] = xb;
+				break;
+			case 3:
+				// indexed
+				pix = ((row[1 + j / cpb]) >> (cpb - 1 - (j % cpb)) * pngdepth) & mask;
+				a[pindex] = pix == bgpix ? 0 : 255;
+				r[pindex] = plte[8+3*pix];
+				g[pindex] = plte[8+3*pix+1];
+				b[pindex] = plte[8+3*pix+2];
+				break;
+			case 4:
+				// greyalpha
+				// assume pngdepth = 8
+				pix = row[1 + 2 * j];
+				xb = pix;
+				alpha = row[1 + 2 * j + 1];
+				a[pindex] = alpha;
+				r[pindex] = xb;
+				g[pindex] = xb;
+				b[pindex] = xb;
+				break;
+			case 2:
+				// RGB
+				// assume pngdepth = 8
+				a[pindex] = 255;
+				r[pindex] = row[1+3*j];
+				g[pindex] = row[1+3*j+1];
+				b[pindex] = row[1+3*j+2];
+				break;
+			case 6:
+				// RGBA
+				// assume pngdepth = 8
+				a[pindex] = row[1+4*j+3];
+				r[pindex] = row[1+4*j];
+				g[pindex] = row[1+4*j+1];
+				b[pindex] = row[1+4*j+2];
+				break;
 			}
-			else {
-				// 16 bpc
-				switch (pngcolourtype) {
-				case 0:
-					// grey
-					pix = Get16(row, 1+nb*j);
-					xb = round(pix / div);	
-					argb[4*pindex+0] = 255;
-					argb[4*pindex+1] = xb;
-					argb[4*pindex+2] = xb;
-					argb[4*pindex+3] = xb;
-					break;
-				case 4:
-					// greyalpha
-					pix = Get16(row, 1+nb*2*j);
-					xb = round(pix / div);
-					alpha = Get16(row, 1+nb*(2*j+1));
-					argb[4*pindex+0] = round(alpha / div);
-					argb[4*pindex+1] = xb;
-					argb[4*pindex+2] = xb;
-					argb[4*pindex+3] = xb;
-					break;
-				case 2:
-					// RGB
-					argb[4*pindex+0] = 255;
-					argb[4*pindex+1] = round(Get16(row, 1+nb*3*j) / div);
-					argb[4*pindex+2] = round(Get16(row, 1+nb*(3*j+1)) / div);
-					argb[4*pindex+3] = round(Get16(row, 1+nb*(3*j+2)) / div);
-					break;
-				case 6:
-					// RGBA
-					argb[4*pindex+0] = round(Get16(row, 1+nb*(4*j+3)) / div);
-					argb[4*pindex+1] = round(Get16(row, 1+nb*4*j) / div);
-					argb[4*pindex+2] = round(Get16(row, 1+nb*(4*j+1)) / div);
-					argb[4*pindex+3] = round(Get16(row, 1+nb*(4*j+2)) / div);
-					break;
-				}
+		}
+		else {
+			// 16 bpc
+			switch (pngcolourtype) {
+			case 0:
+				// grey
+				pix = Get16(row, 1+nb*j);
+				xb = round(pix / div);	
+				a[pindex] = 255;
+				r[pindex] = xb;
+				g[pindex] = xb;
+				b[pindex] = xb;
+				break;
+			case 4:
+				// greyalpha
+				pix = Get16(row, 1+nb*2*j);
+				xb = round(pix / div);
+				alpha = Get16(row, 1+nb*(2*j+1));
+				a[pindex] = round(alpha / div);
+				r[pindex] = xb;
+				g[pindex] = xb;
+				b[pindex] = xb;
+				break;
+			case 2:
+				// RGB
+				a[pindex] = 255;
+				r[pindex] = round(Get16(row, 1+nb*3*j) / div);
+				g[pindex] = round(Get16(row, 1+nb*(3*j+1)) / div);
+				b[pindex] = round(Get16(row, 1+nb*(3*j+2)) / div);
+				break;
+			case 6:
+				// RGBA
+				a[pindex] = round(Get16(row, 1+nb*(4*j+3)) / div);
+				r[pindex] = round(Get16(row, 1+nb*4*j) / div);
+				g[pindex] = round(Get16(row, 1+nb*(4*j+1)) / div);
+				b[pindex] = round(Get16(row, 1+nb*(4*j+2)) / div);
+				break;
 			}
 		}
-		row += rowbytes + 1;
 	}
-	return (rowbytes+1) * height;
+}
+
+// adam7: where each pass starts, and log2 of its pixel spacing, across and down
+static const int kAdam7HStarts[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int kAdam7VStarts[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int kAdam7HShifts[7] = { 3, 3, 2, 2, 1, 1, 0 };
+static const int kAdam7VShifts[7] = { 3, 3, 3, 2, 2, 1, 1 };
+
+// pixels of the whole image in pass, across or down
+static long Adam7PassSize(long size, int start, int shift)
+{
+	return (size + (1 << shift) - 1 - start) >> shift;
+}
+
+// the zlib stream of the IDAT chunks, inflated a scanline at a time
+// the compressed bytes are read where they are in the png, a chunk at a time
+struct IDATReader_ {
+	z_stream z;
+	int zr;	// what inflate said last
+	const uint8_t *idat;	// next chunk to feed in
+	const uint8_t *pngend;
+	int crcpolicy;
+	boolean checkcrc;	// for the next chunk
+	const Exe2ICNSContext *ctx;	// for the log
+};
+typedef struct IDATReader_ IDATReader;
+
+static int IDATReaderInit(IDATReader *reader, const uint8_t *idat, const uint8_t *pngend, int crcpolicy, const Exe2ICNSContext *ctx)
+{
+	z_stream *z = &reader->z;
+	z->zalloc = ZAlloc;
+	z->zfree = ZFree;
+	z->opaque = ctx ? (voidpf)&ctx->allocator : NULL;
+	z->next_in = NULL;
+	z->avail_in = 0;
+	reader->zr = Z_OK;
+	reader->idat = idat;
+	reader->pngend = pngend;
+	reader->crcpolicy = crcpolicy;
+	reader->checkcrc = crcpolicy != kExe2ICNSCRCNone;
+	reader->ctx = ctx;
+	if (inflateInit(z) != Z_OK) {
+		LogMessage(ctx, kExe2ICNSLogWarning, "zlib inflateInit error: %s", z->msg);
+		return -1;
+	}
+	return 0;
+}
+
+// the next size bytes of the stream into out; returns 0 or -1
+static int ReadIDATs(IDATReader *reader, uint8_t *out, long size)
+{
+	z_stream *z = &reader->z;
+	z->next_out = out;
+	z->avail_out = size;
+	while (reader->zr == Z_OK && z->avail_out > 0) {
+		const uint8_t *idat = reader->idat;
+		long chunksize;
+		if (z->avail_in > 0) {
+			reader->zr = inflate(z, Z_NO_FLUSH);
+			continue;
+		}
+		if (idat == NULL || reader->pngend - idat < 12 || Get32(idat, 4) != 'IDAT')
+			break;
+		chunksize = Get32(idat, 0);
+		if (chunksize > reader->pngend - idat - 12) {
+			LogMessage(reader->ctx, kExe2ICNSLogWarning, "png IDAT is cut short");
+			chunksize = reader->pngend - idat - 12;
+		}
+		else if (reader->checkcrc)
+			CheckCRC(idat, reader->ctx);
+		// sampled: the first IDAT only
+		reader->checkcrc = reader->crcpolicy == kExe2ICNSCRCAll;
+		z->next_in = (Bytef *)idat + 8;
+		z->avail_in = chunksize;
+		reader->idat = idat + 12 + chunksize;
+	}
+	
+	if (reader->zr != Z_OK && reader->zr != Z_STREAM_END) {
+		LogMessage(reader->ctx, kExe2ICNSLogWarning, "zlib inflate error: %s", z->msg ? z->msg : zError(reader->zr));
+		return -1;
+	}
+	if (z->avail_out > 0) {
+		if (reader->zr != Z_STREAM_END) {
+			LogMessage(reader->ctx, kExe2ICNSLogWarning, "png image data is cut short");
+			return -1;
+		}
+		// the stream says it's done: the rows it left out are blank
+		memset(z->next_out, 0, z->avail_out);
+	}
+	return 0;
+}
+
+static void IDATReaderEnd(IDATReader *reader)
+{
+	if (reader->zr == Z_STREAM_END && reader->z.avail_out > 0)
+		LogMessage(reader->ctx, kExe2ICNSLogWarning, "png image data ends early");
+	inflateEnd(&reader->z);
 }
 
 /* simple expansion without colour profile / gamma conversion */
-void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
+int ExpandPNG(const void *png, long pngsize, const PNGDecodeOptions *options, Image *image, const Exe2ICNSContext *ctx)
 {
+	const Exe2ICNSAllocator *allocator = ctx ? &ctx->allocator : NULL;
 	char pngsig[8] = "\x89PNG\15\12\32\12";
 	const uint8_t *pngp = png;
 	const uint8_t *pngend = pngp + pngsize;
-	uint32_t crc;
+	int crcpolicy = options ? options->crc : kExe2ICNSCRCAll;
+	boolean checkcrc = crcpolicy != kExe2ICNSCRCNone;
 	long ihdroff = 8;
 	// ihdr data
 	const uint8_t *ihdr = pngp + 8;
@@ -623,30 +717,26 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 	unsigned char pngdepth, pngcolourtype, pngcompression, pngfilter, pnginterlace;
 	const uint8_t *plte;
 	const uint8_t *bkgd;
-	const uint8_t *idat;
-	long payloadsize;
-	uint8_t *payload;
-	uint8_t *stream;
-	unsigned long streamsize;
-	uint8_t *argb;
+	int ncomp;
+	int bpp;	// bytes per pixel for the filters
+	int bgpix;
+	long rowbytes;
+	uint8_t *rows;
+	IDATReader reader;
+	int pass;
+	int r = 0;
 	
 	if (memcmp(pngp, pngsig, 8) != 0) {
-		fprintf(stderr, "ExpandPNG: not a png data\n");
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "not png data");
+		return -1;
 	}
 	
-	MakeCRCTable();
-	
 	if (memcmp(ihdr, "\0\0\0\15IHDR", 8) != 0) {
-		fprintf(stderr, "ExpandPNG: can't find IHDR\n");
-		return NULL;
-	}
-	crc = UpdateCRC(-1, ihdr + 4, 17);
-	if (Get32(ihdr, 21) != ~ crc) {
-		fprintf(stderr, "CRC mismatch on IHDR (expected %08X, found %08X)\n", (int)~ crc, (int)Get32(ihdr, 21));
+		LogMessage(ctx, kExe2ICNSLogWarning, "png IHDR not found");
+		return -1;
 	}
-	
-	CheckCRC(ihdr);
+	if (checkcrc)
+		CheckCRC(ihdr, ctx);
 	
 	pngwid = Get32(ihdr, 8);
 	pnghei = Get32(ihdr, 12);
@@ -663,21 +753,21 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 		if (pngcolourtype == 0 || pngcolourtype == 3)
 			;
 		else {
-			fprintf(stderr, "unsupported colour depth/type (%d/%d)\n", pngdepth, pngcolourtype);
-			return NULL;
+			LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png colour depth/type (%d/%d)", pngdepth, pngcolourtype);
+			return -1;
 		}
 		break;
 	case 16:
 		if (pngcolourtype == 3) {
-			fprintf(stderr, "unsupported colour depth/type (%d/%d)\n", pngdepth, pngcolourtype);
-			return NULL;
+			LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png colour depth/type (%d/%d)", pngdepth, pngcolourtype);
+			return -1;
 		}
 		break;
 	case 8:
 		break;
 	default:
-		fprintf(stderr, "unsupported colour depth (%d)\n", pngdepth);
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png colour depth (%d)", pngdepth);
+		return -1;
 	}
 	switch (pngcolourtype) {
 	case 0:	// grey
@@ -687,142 +777,95 @@ void * ExpandPNG(const void *png, long pngsize, long *outwid, long *outhei)
 	case 6:	// rgbalpha
 		break;
 	default:
-		fprintf(stderr, "unsupported colour type (%d)\n", pngcolourtype);
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png colour type (%d)", pngcolourtype);
+		return -1;
 	}
 	if (pngcompression != 0) {
-		fprintf(stderr, "unsupported compression method (%d)\n", pngcompression);
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png compression method (%d)", pngcompression);
+		return -1;
 	}
 	if (pngfilter != 0) {
-		fprintf(stderr, "unsupported filter method (%d)\n", pngfilter);
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png filter method (%d)", pngfilter);
+		return -1;
 	}
 	if (pnginterlace == 0 || pnginterlace == 1)
 		;
 	else {
-		fprintf(stderr, "unsupported interlace method (%d)\n", pnginterlace);
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "unsupported png interlace method (%d)", pnginterlace);
+		return -1;
 	}
 	
 	plte = FindChunk(ihdr, pngend, 'PLTE');
-	if (plte)
-		CheckCRC(plte);
+	if (plte && checkcrc)
+		CheckCRC(plte, ctx);
 	
 	if (pngcolourtype == 3 && plte == NULL) {
-		fprintf(stderr, "indexed colour png but palette is not found\n");
-		return NULL;
+		LogMessage(ctx, kExe2ICNSLogWarning, "indexed colour png but palette is not found");
+		return -1;
 	}
 	
 	bkgd = FindChunk(ihdr, pngend, 'bKGD');
-	if (bkgd)
-		CheckCRC(bkgd);
-	
-	// concatenate all IDAT
-	idat = FindChunk(ihdr, pngend, 'IDAT');
-	payloadsize = 0;
-	payload = malloc(0);
-	while (idat && Get32(idat, 4) == 'IDAT') {
-		long size = Get32(idat, 0);
-		uint8_t *p;
-		CheckCRC(idat);
-		p = realloc(payload, payloadsize + size);
-		if (p) {
-			payload = p;
-		}
-		else {	
-			free(payload);
-			fprintf(stderr, "ExpandPNG: no memory\n");
-			return NULL;
-		}
-		memmove(payload + payloadsize, idat + 8, size);
-		payloadsize += size;
-		idat += 12 + size;
+	if (bkgd && checkcrc)
+		CheckCRC(bkgd, ctx);
+	
+	// a scanline is inflated, unfiltered against the one above and put into image before the next is read,
+	// so only these two are ever kept
+	ncomp = PNGNComponents(pngcolourtype);
+	rowbytes = (pngdepth * ncomp * pngwid + 7) / 8;
+	bpp = pngdepth < 8 ? 1 : (pngdepth + 7) / 8 * ncomp;
+	bgpix = BackgroundPixel(bkgd, pngcolourtype);
+	rows = MemAlloc(allocator, 2 * (rowbytes + 1));
+	if (rows == NULL || IDATReaderInit(&reader, FindChunk(ihdr, pngend, 'IDAT'), pngend, crcpolicy, ctx) != 0) {
+		MemFree(allocator, rows);
+		return -1;
 	}
-	
-	stream = InflateAllAtOnce(payload, payloadsize, (pngwid*PNGNComponents(pngcolourtype)*pngdepth + 7)/8 * pnghei, &streamsize);
-	
-	free(payload);
-	
-	if (stream == NULL) {
-		return NULL;
+	if (ImageAlloc(image, pngwid, pnghei, allocator) != 0) {
+		IDATReaderEnd(&reader);
+		MemFree(allocator, rows);
+		return -1;
 	}
 	
-	argb = malloc(4 * pngwid * pnghei);
-	
-	if (pnginterlace == 1) {
-		int pass;
-		const int hshifts[7] = { 3, 3, 2, 2, 1, 1, 0 };
-		const int vshifts[7] = { 3, 3, 3, 2, 2, 1, 1 };
-		const int hstarts[7] = { 0, 4, 0, 2, 0, 1, 0 };
-		const int vstarts[7] = { 0, 0, 4, 0, 2, 0, 1 };
-		int hshift, vshift;
-		int hstart, vstart;
-		long subwid;
-		long subhei;
-		uint8_t *substream = stream;
-		long subimglen;
-		// adam7
-		for (pass = 0; pass < 7; pass++) {
-			hshift = hshifts[pass];
-			vshift = vshifts[pass];
-			hstart = hstarts[pass];
-			vstart = vstarts[pass];
-			subwid = (pngwid + (1 << hshift) - 1 - hstart) >> hshift;
-			subhei = (pngwid + (1 << vshift) - 1 - vstart) >> vshift;
-		
-			subimglen = ToARGB(substream, subwid, subhei, pngdepth, pngcolourtype, plte, bkgd, &argb[0/*4*(vstart*pngwid+hstart)*/], pngwid, hstart, vstart, hshift, vshift);
-			substream += subimglen;
+	for (pass = 0; r == 0 && pass < (pnginterlace ? 7 : 1); pass++) {
+		// a png that isn't interlaced is one pass of every pixel
+		int hstart = pnginterlace ? kAdam7HStarts[pass] : 0;
+		int vstart = pnginterlace ? kAdam7VStarts[pass] : 0;
+		int hshift = pnginterlace ? kAdam7HShifts[pass] : 0;
+		int vshift = pnginterlace ? kAdam7VShifts[pass] : 0;
+		long passwid = Adam7PassSize(pngwid, hstart, hshift);
+		long passhei = Adam7PassSize(pnghei, vstart, vshift);
+		long passrowbytes = (pngdepth * ncomp * passwid + 7) / 8;
+		uint8_t *prev = rows;
+		uint8_t *cur = rows + rowbytes + 1;
+		long i;
+		// an empty pass has no scanlines at all
+		if (passwid == 0)
+			continue;
+		memset(prev, 0, passrowbytes + 1);
+		for (i = 0; r == 0 && i < passhei; i++) {
+			uint8_t *swap;
+			r = ReadIDATs(&reader, cur, passrowbytes + 1);
+			if (r != 0)
+				break;
+			UnfilterRow(cur, prev, passrowbytes, bpp);
+			ConvertRow(cur, passwid, pngdepth, pngcolourtype, plte, bgpix, image, (i << vshift) + vstart, hstart, hshift);
+			swap = prev;
+			prev = cur;
+			cur = swap;
 		}
 	}
-	else if (pnginterlace == 0) {
-		ToARGB(stream, pngwid, pnghei, pngdepth, pngcolourtype, plte, bkgd, argb, pngwid, 0, 0, 0, 0);
-	}
-	else {
-		fprintf(stderr, "ExpandPNG: unknown interlace method %d\n", pnginterlace);
-		free(stream);
-		free(argb);
-		return NULL;
-	}
-	
-	free(stream);
 	
-	if (outwid)
-		*outwid = pngwid;
-	if (outhei)
-		*outhei = pnghei;
-	return argb;
+	IDATReaderEnd(&reader);
+	MemFree(allocator, rows);
+	if (r != 0) {
+		ImageFree(image, allocator);
+		return -1;
+	}
+	return 0;
 }
 
 #ifdef TEST
 
-void Dump(const void *data, long len)
-{
-	long i;
-	const uint8_t *p = data;
-	while (len > 0) {
-		long slen = 16;
-		if (len < slen)
-			slen = len;
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%02hhX ", p[i]);
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, "   ");
-		}
-		for (i = 0; i < slen; i++) {
-			fprintf(stderr, "%c", isprint(p[i]) ? p[i] : '.');
-		}
-		for ( ; i < 16; i++) {
-			fprintf(stderr, " ");
-		}
-		fputs("\n", stderr);
-		len -= slen;
-		p += 16;
-	}
-}
-
-void MakeRGBATIFF(const char *filename, void *data, int width, int height)
+static void MakeRGBATIFF(const char *filename, void *data, int width, int height)
 {
 	if (data == NULL) {
 		fprintf(stderr, "NULL tiff?\n");
@@ -885,48 +928,26 @@ int main(int argc, char *argv[])
 		if (fp) {
 			long sz;
 			char *buf;
-			char *buf2;
+			uint8_t *rgba;
 			char *buf3;
-			char *mask;
 			long size;
-			long wid, hei;
+			Image image;
+			int i;
 			fseek(fp, 0, SEEK_END);
 			sz = ftell(fp);
 			buf = malloc(sz);
 			rewind(fp);
 			fread(buf, 1, sz, fp);
-			Dump(buf, 16);
-			buf2 = ExpandPNG(buf, sz, &wid, &hei);
-			mask = malloc(wid * hei);
-			if (buf2) {
-				// ARGB->RGBA
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					mask[i] = buf2[i*4+0];
-					buf2[i*4+0] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+3];
-					buf2[i*4+3] = mask[i];
-				}
-			}
-			else {
-				fprintf(stderr, "ExpandPNG returned NULL\n");
+			if (ExpandPNG(buf, sz, NULL, &image, NULL) != 0) {
+				fprintf(stderr, "ExpandPNG failed\n");
 				free(buf);
-				free(mask);
 				return 1;
 			}
-			MakeRGBATIFF("test.tiff", buf2, wid, hei);
-			{
-				// back to ARGB
-				int i;
-				for (i = 0; i < wid * hei; i++) {
-					//mask[i] = buf2[i*4+3];
-					buf2[i*4+3] = buf2[i*4+2];
-					buf2[i*4+2] = buf2[i*4+1];
-					buf2[i*4+1] = buf2[i*4+0];
-				}
-			}
-			buf3 = CompressToPNG(wid, hei, buf2, mask, &size);
+			rgba = malloc(4 * image.width * image.height);
+			for (i = 0; i < image.height; i++)
+				ImageGetRGBARow(&image, i, rgba + 4 * i * image.width);
+			MakeRGBATIFF("test.tiff", rgba, image.width, image.height);
+			buf3 = CompressToPNG(&image, NULL, &size, NULL);
 			fprintf(stderr, "%ld bytes PNG\n", size);
 			{
 				FILE *fp = fopen("test.png", "wb");
@@ -935,9 +956,9 @@ int main(int argc, char *argv[])
 				fclose(fp);
 			}
 			free(buf);
-			free(buf2);
+			free(rgba);
 			free(buf3);
-			free(mask);
+			ImageFree(&image, NULL);
 		}
 		fclose(fp);
 		return 0;
@@ -0,0 +1,472 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include "resample.h"
+#include "arena.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define RESAMPLE_USE_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RESAMPLE_USE_AVX2 1
+#endif
+
+enum {
+	kLinearMax = 65535	// linear light is kept in 16 bits
+};
+
+// written once by MakeGammaTables, read-only afterwards
+// averaging 4 samples in 16-bit linear light and rounding back lands within 1 of doing it with pow
+// the padding lets a 32-bit gather of the last entry stay inside the table
+static uint16_t gToLinear[256 + 1];
+static uint8_t gFromLinear[kLinearMax + 1 + 3];
+static pthread_once_t gGammaOnce = PTHREAD_ONCE_INIT;
+
+static void MakeGammaTables(void)
+{
+	int i;
+	for (i = 0; i < 256; i++)
+		gToLinear[i] = pow(i / 255.0, 2.2) * kLinearMax + 0.5;
+	for (i = 0; i <= kLinearMax; i++)
+		gFromLinear[i] = pow(i / (double)kLinearMax, 1 / 2.2) * 255 + 0.5;
+}
+
+// (a + b + c + d + 2) / 4 of each 2 x 2 block of two mask rows
+static void HalveMaskRows(int width, const uint8_t *row0, const uint8_t *row1, uint8_t *out)
+{
+	int j = 0;
+#if RESAMPLE_USE_SSE2
+	const __m128i lowbyte = _mm_set1_epi16(0xFF);
+	const __m128i two = _mm_set1_epi16(2);
+	for (; j + 32 <= width; j += 32) {
+		__m128i sum[2];
+		int k;
+		for (k = 0; k < 2; k++) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + j + 16 * k));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + j + 16 * k));
+			// even and odd columns of both rows, in 16-bit lanes
+			__m128i s = _mm_add_epi16(_mm_and_si128(a, lowbyte), _mm_srli_epi16(a, 8));
+			s = _mm_add_epi16(s, _mm_and_si128(b, lowbyte));
+			s = _mm_add_epi16(s, _mm_srli_epi16(b, 8));
+			sum[k] = _mm_srli_epi16(_mm_add_epi16(s, two), 2);
+		}
+		_mm_storeu_si128((__m128i *)(out + j / 2), _mm_packus_epi16(sum[0], sum[1]));
+	}
+#endif
+	for (; j < width; j += 2)
+		out[j / 2] = (row0[j] + row0[j + 1] + row1[j] + row1[j + 1] + 2) / 4;
+}
+
+// the same for a colour plane, averaged in linear light
+// with AVX2, 8 blocks at a time: the table entries are gathered and added up in 32-bit lanes
+// (without gathers, filling vectors one entry at a time is slower than this scalar loop)
+static void HalveColourRows(int width, const uint8_t *row0, const uint8_t *row1, uint8_t *out)
+{
+	int j = 0;
+#if RESAMPLE_USE_AVX2
+	const __m128i lowbyte = _mm_set1_epi16(0xFF);
+	const __m256i lowword = _mm256_set1_epi32(0xFFFF);
+	const __m256i two = _mm256_set1_epi32(2);
+	for (; j + 16 <= width; j += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(row0 + j));
+		__m128i b = _mm_loadu_si128((const __m128i *)(row1 + j));
+		// the even and odd columns of both rows, as 32-bit indices
+		__m256i idx[4];
+		__m256i sum = two;
+		__m128i packed;
+		int k;
+		idx[0] = _mm256_cvtepu16_epi32(_mm_and_si128(a, lowbyte));
+		idx[1] = _mm256_cvtepu16_epi32(_mm_srli_epi16(a, 8));
+		idx[2] = _mm256_cvtepu16_epi32(_mm_and_si128(b, lowbyte));
+		idx[3] = _mm256_cvtepu16_epi32(_mm_srli_epi16(b, 8));
+		for (k = 0; k < 4; k++)
+			sum = _mm256_add_epi32(sum, _mm256_and_si256(_mm256_i32gather_epi32((const int *)gToLinear, idx[k], 2), lowword));
+		sum = _mm256_i32gather_epi32((const int *)gFromLinear, _mm256_srli_epi32(sum, 2), 1);
+		sum = _mm256_and_si256(sum, _mm256_set1_epi32(0xFF));
+		packed = _mm_packs_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		_mm_storel_epi64((__m128i *)(out + j / 2), _mm_packus_epi16(packed, packed));
+	}
+#endif
+	for (; j < width; j += 2) {
+		unsigned sum = gToLinear[row0[j]] + gToLinear[row0[j + 1]] + gToLinear[row1[j]] + gToLinear[row1[j + 1]];
+		out[j / 2] = gFromLinear[(sum + 2) / 4];
+	}
+}
+
+void HalveImage(const Image *image, Image *out)
+{
+	int width = image->width;
+	int i, c;
+	pthread_once(&gGammaOnce, MakeGammaTables);
+	for (c = 0; c < kImagePlanes; c++) {
+		for (i = 0; i < image->height / 2; i++) {
+			const uint8_t *row0 = image->planes[c] + (long)(2 * i) * width;
+			const uint8_t *row1 = row0 + width;
+			uint8_t *q = out->planes[c] + (long)i * out->width;
+			if (c == kImageA)
+				HalveMaskRows(width, row0, row1, q);
+			else
+				HalveColourRows(width, row0, row1, q);
+		}
+	}
+}
+
+// taps of one axis: output pixel i is the sum of weights[i * ntaps + k] * input pixel first[i] + k
+struct AxisWeights_ {
+	int ntaps;
+	int *first;
+	float *weights;
+};
+typedef struct AxisWeights_ AxisWeights;
+
+static double Sinc(double x)
+{
+	if (x == 0)
+		return 1;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+// weight of the input pixel at d input pixels from the centre of an output pixel that spans scale input pixels
+static double FilterWeight(int filter, double d, double scale)
+{
+	double x = fabs(d) / scale;
+	if (filter == kExe2ICNSFilterTriangle)
+		return x < 1 ? 1 - x : 0;
+	else if (filter == kExe2ICNSFilterLanczos3)
+		return x < 3 ? Sinc(x) * Sinc(x / 3) : 0;
+	else {
+		// how much of the input pixel the output pixel covers
+		double lo = d - 0.5 > -scale / 2 ? d - 0.5 : -scale / 2;
+		double hi = d + 0.5 < scale / 2 ? d + 0.5 : scale / 2;
+		return hi > lo ? hi - lo : 0;
+	}
+}
+
+// the taps that fall off the edge are given to the edge pixel
+static int MakeAxisWeights(AxisWeights *aw, int filter, int insize, int outsize, const Exe2ICNSAllocator *allocator)
+{
+	double scale = (double)insize / outsize;
+	double filterscale = scale > 1 ? scale : 1;	// upscaling interpolates
+	double support = (filter == kExe2ICNSFilterLanczos3 ? 3 : filter == kExe2ICNSFilterTriangle ? 1 : 0.5) * filterscale + 0.5;
+	int nspan = (int)ceil(2 * support) + 1;
+	int ntaps = nspan < insize ? nspan : insize;
+	int i, k;
+	
+	aw->ntaps = ntaps;
+	aw->first = MemAlloc(allocator, outsize * sizeof(int));
+	aw->weights = MemAlloc(allocator, (size_t)outsize * ntaps * sizeof(float));
+	if (aw->first == NULL || aw->weights == NULL)
+		return -1;
+	for (i = 0; i < outsize; i++) {
+		double centre = (i + 0.5) * scale - 0.5;
+		int start = (int)floor(centre - support) + 1;
+		int first = start > 0 ? start : 0;
+		float *w = aw->weights + i * ntaps;
+		double sum = 0;
+		if (first > insize - ntaps)
+			first = insize - ntaps;
+		for (k = 0; k < ntaps; k++)
+			w[k] = 0;
+		for (k = 0; k < nspan; k++) {
+			int j = start + k;
+			double v = FilterWeight(filter, j - centre, filterscale);
+			j = j < 0 ? 0 : j >= insize ? insize - 1 : j;
+			w[j - first] += v;
+			sum += v;
+		}
+		if (sum != 0) {
+			for (k = 0; k < ntaps; k++)
+				w[k] /= sum;
+		}
+		aw->first[i] = first;
+	}
+	return 0;
+}
+
+static void FreeAxisWeights(AxisWeights *aw, const Exe2ICNSAllocator *allocator)
+{
+	MemFree(allocator, aw->first);
+	MemFree(allocator, aw->weights);
+}
+
+// the pixels being filtered are 4 floats each: mask, then r, g, b in linear light multiplied by the mask
+// one pixel fits an SSE register
+
+// *out = sum of src[k] * weights[k] for k < ntaps
+static void SumPixels(float *out, const float *src, const float *weights, int ntaps)
+{
+	int k;
+#if RESAMPLE_USE_SSE2
+	__m128 acc = _mm_setzero_ps();
+	for (k = 0; k < ntaps; k++)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + 4 * k), _mm_set1_ps(weights[k])));
+	_mm_storeu_ps(out, acc);
+#else
+	int c;
+	for (c = 0; c < 4; c++)
+		out[c] = 0;
+	for (k = 0; k < ntaps; k++) {
+		for (c = 0; c < 4; c++)
+			out[c] += src[4 * k + c] * weights[k];
+	}
+#endif
+}
+
+// acc[i] += src[i] * weight for n pixels
+static void AddPixels(float *acc, const float *src, float weight, int n)
+{
+	int i = 0;
+#if RESAMPLE_USE_SSE2
+	__m128 w = _mm_set1_ps(weight);
+	for (; i < n; i++)
+		_mm_storeu_ps(acc + 4 * i, _mm_add_ps(_mm_loadu_ps(acc + 4 * i), _mm_mul_ps(_mm_loadu_ps(src + 4 * i), w)));
+#else
+	for (i = 0; i < 4 * n; i++)
+		acc[i] += src[i] * weight;
+#endif
+}
+
+static int FromLinear(float v)
+{
+	v = v * kLinearMax + 0.5f;
+	return gFromLinear[v <= 0 ? 0 : v >= kLinearMax ? kLinearMax : (int)v];
+}
+
+int ResampleImage(int filter, const Image *image, Image *out, const Exe2ICNSAllocator *allocator)
+{
+	int width = image->width, height = image->height;
+	int outwidth = out->width, outheight = out->height;
+	AxisWeights xw, yw;
+	float *row;	// one input row
+	float *columns;	// input rows scaled to outwidth
+	float *acc;	// one output row
+	int i, j, k;
+	int r;
+	
+	pthread_once(&gGammaOnce, MakeGammaTables);
+	xw.first = yw.first = NULL;
+	xw.weights = yw.weights = NULL;
+	row = MemAlloc(allocator, (size_t)width * 4 * sizeof(float));
+	columns = MemAlloc(allocator, (size_t)outwidth * height * 4 * sizeof(float));
+	acc = MemAlloc(allocator, (size_t)outwidth * 4 * sizeof(float));
+	if (row == NULL || columns == NULL || acc == NULL
+			|| MakeAxisWeights(&xw, filter, width, outwidth, allocator) != 0
+			|| MakeAxisWeights(&yw, filter, height, outheight, allocator) != 0)
+		r = -1;
+	else {
+		for (i = 0; i < height; i++) {
+			long off = (long)i * width;
+			const uint8_t *pr = image->planes[kImageR] + off;
+			const uint8_t *pg = image->planes[kImageG] + off;
+			const uint8_t *pb = image->planes[kImageB] + off;
+			const uint8_t *pa = image->planes[kImageA] + off;
+			for (j = 0; j < width; j++) {
+				float a = pa[j] * (1.0f / 255);
+				row[4*j + 0] = a;
+				row[4*j + 1] = gToLinear[pr[j]] * (a / kLinearMax);
+				row[4*j + 2] = gToLinear[pg[j]] * (a / kLinearMax);
+				row[4*j + 3] = gToLinear[pb[j]] * (a / kLinearMax);
+			}
+			for (j = 0; j < outwidth; j++)
+				SumPixels(columns + 4 * (i * outwidth + j), row + 4 * xw.first[j], xw.weights + j * xw.ntaps, xw.ntaps);
+		}
+		
+		for (i = 0; i < outheight; i++) {
+			const float *w = yw.weights + i * yw.ntaps;
+			long off = (long)i * outwidth;
+			uint8_t *qr = out->planes[kImageR] + off;
+			uint8_t *qg = out->planes[kImageG] + off;
+			uint8_t *qb = out->planes[kImageB] + off;
+			uint8_t *qa = out->planes[kImageA] + off;
+			for (j = 0; j < 4 * outwidth; j++)
+				acc[j] = 0;
+			for (k = 0; k < yw.ntaps; k++)
+				AddPixels(acc, columns + 4 * (yw.first[i] + k) * outwidth, w[k], outwidth);
+			for (j = 0; j < outwidth; j++) {
+				float a = acc[4*j + 0];
+				if (a * 255 >= 0.5f) {
+					qr[j] = FromLinear(acc[4*j + 1] / a);
+					qg[j] = FromLinear(acc[4*j + 2] / a);
+					qb[j] = FromLinear(acc[4*j + 3] / a);
+					qa[j] = a >= 1 ? 255 : (int)(a * 255 + 0.5f);
+				}
+				else {
+					qr[j] = qg[j] = qb[j] = 0;
+					qa[j] = 0;
+				}
+			}
+		}
+		r = 0;
+	}
+	
+	FreeAxisWeights(&xw, allocator);
+	FreeAxisWeights(&yw, allocator);
+	MemFree(allocator, row);
+	MemFree(allocator, columns);
+	MemFree(allocator, acc);
+	return r;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+// what the 128 x 128 icon synthesis used to do for every component
+static double GammaCorrectedAverage(double ingamma, double outgamma, int n, ...)
+{
+	int i;
+	va_list ap;
+	double sum = 0;
+	double outrgamma = 1.0 / outgamma;
+	
+	va_start(ap, n);
+	for (i = 0; i < n; i++) {
+		double v = va_arg(ap, double);
+		sum += pow(v, ingamma);
+	}
+	sum /= n;
+	va_end(ap);
+	return pow(sum, outrgamma);
+}
+
+// halve one 2 x 2 block with the given components and compare with the pow version
+static int Check(int a, int b, int c, int d)
+{
+	static Image block, out;
+	int ref = 255 * GammaCorrectedAverage(2.2, 2.2, 4, a/255.0, b/255.0, c/255.0, d/255.0) + 0.5;
+	int k;
+	if (block.planes[0] == NULL) {
+		ImageAlloc(&block, 2, 2, NULL);
+		ImageAlloc(&out, 1, 1, NULL);
+	}
+	for (k = 0; k < kImagePlanes; k++) {
+		block.planes[k][0] = a, block.planes[k][1] = b, block.planes[k][2] = c, block.planes[k][3] = d;
+	}
+	HalveImage(&block, &out);
+	if (abs(out.planes[kImageR][0] - ref) > 1) {
+		fprintf(stderr, "%d %d %d %d: %d, should be %d\n", a, b, c, d, out.planes[kImageR][0], ref);
+		return 1;
+	}
+	if (out.planes[kImageA][0] != (a + b + c + d + 2) / 4) {
+		fprintf(stderr, "%d %d %d %d: mask %d\n", a, b, c, d, out.planes[kImageA][0]);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int a, b, c, i, errors = 0;
+	Image image, out, box;
+	
+	// every pair, then random blocks
+	for (a = 0; a < 256; a++) {
+		for (b = 0; b < 256; b++) {
+			errors += Check(a, a, b, b);
+			errors += Check(a, b, b, b);
+		}
+	}
+	srand(1);
+	for (i = 0; i < 1000000; i++)
+		errors += Check(rand() & 255, rand() & 255, rand() & 255, rand() & 255);
+	
+	// a whole image, so that the vector loops get used too
+	ImageAlloc(&image, 256, 256, NULL);
+	ImageAlloc(&out, 128, 128, NULL);
+	for (c = 0; c < kImagePlanes; c++) {
+		for (i = 0; i < 256 * 256; i++)
+			image.planes[c][i] = rand();
+	}
+	HalveImage(&image, &out);
+	for (i = 0; i < 128 * 128; i++) {
+		int y = i / 128 * 2, x = i % 128 * 2;
+		const uint8_t *m = image.planes[kImageA];
+		int sum = m[y*256+x] + m[y*256+x+1] + m[(y+1)*256+x] + m[(y+1)*256+x+1];
+		for (c = kImageR; c <= kImageB; c++) {
+			const uint8_t *p = image.planes[c];
+			int ref = 255 * GammaCorrectedAverage(2.2, 2.2, 4,
+				p[y*256+x]/255.0, p[y*256+x+1]/255.0,
+				p[(y+1)*256+x]/255.0, p[(y+1)*256+x+1]/255.0) + 0.5;
+			if (abs(out.planes[c][i] - ref) > 1)
+				errors++;
+		}
+		if (out.planes[kImageA][i] != (sum + 2) / 4)
+			errors++;
+	}
+	
+	// box filtering an opaque image down by 2 is the same thing, give or take rounding
+	for (i = 0; i < 256 * 256; i++)
+		image.planes[kImageA][i] = 255;
+	HalveImage(&image, &out);
+	ImageAlloc(&box, 128, 128, NULL);
+	if (ResampleImage(kExe2ICNSFilterBox, &image, &box, NULL) != 0)
+		errors++;
+	for (c = 0; c < kImagePlanes; c++) {
+		for (i = 0; i < 128 * 128; i++) {
+			if (abs(box.planes[c][i] - out.planes[c][i]) > 1)
+				errors++;
+		}
+	}
+	ImageFree(&box, NULL);
+	
+	// the vector loops give exactly what the tables give, at every width across their 16 column steps
+	for (a = 2; a <= 68; a += 2) {
+		Image rows, half;
+		ImageAlloc(&rows, a, 2, NULL);
+		ImageAlloc(&half, a / 2, 1, NULL);
+		for (c = 0; c < kImagePlanes; c++) {
+			for (i = 0; i < 2 * a; i++)
+				rows.planes[c][i] = rand();
+		}
+		HalveImage(&rows, &half);
+		for (c = kImageR; c <= kImageB; c++) {
+			const uint8_t *p = rows.planes[c];
+			for (i = 0; i < a / 2; i++) {
+				unsigned sum = gToLinear[p[2*i]] + gToLinear[p[2*i+1]] + gToLinear[p[a+2*i]] + gToLinear[p[a+2*i+1]];
+				if (half.planes[c][i] != gFromLinear[(sum + 2) / 4]) {
+					fprintf(stderr, "%d columns: %d at %d, should be %d\n", a, half.planes[c][i], i, gFromLinear[(sum + 2) / 4]);
+					errors++;
+					break;
+				}
+			}
+		}
+		ImageFree(&rows, NULL);
+		ImageFree(&half, NULL);
+	}
+	
+	// a flat colour stays the same whatever the filter and the size
+	memset(image.planes[kImageR], 200, 256 * 256);
+	memset(image.planes[kImageG], 100, 256 * 256);
+	memset(image.planes[kImageB], 3, 256 * 256);
+	memset(image.planes[kImageA], 128, 256 * 256);
+	for (a = kExe2ICNSFilterBox; a <= kExe2ICNSFilterLanczos3; a++) {
+		static const int sizes[] = { 16, 32, 48, 100, 128 };
+		for (b = 0; b < 5; b++) {
+			int n = sizes[b];
+			Image flat;
+			ImageAlloc(&flat, n, n, NULL);
+			if (ResampleImage(a, &image, &flat, NULL) != 0)
+				errors++;
+			for (i = 0; i < n * n; i++) {
+				if (abs(flat.planes[kImageR][i] - 200) > 1 || abs(flat.planes[kImageG][i] - 100) > 1 || abs(flat.planes[kImageB][i] - 3) > 1 || flat.planes[kImageA][i] != 128) {
+					fprintf(stderr, "filter %d, %d x %d: %d %d %d %d\n", a, n, n, flat.planes[kImageR][i], flat.planes[kImageG][i], flat.planes[kImageB][i], flat.planes[kImageA][i]);
+					errors++;
+					break;
+				}
+			}
+			ImageFree(&flat, NULL);
+		}
+	}
+	ImageFree(&image, NULL);
+	ImageFree(&out, NULL);
+	
+	fprintf(stderr, "%d error(s)\n", errors);
+	return errors != 0;
+}
+#endif	// TEST
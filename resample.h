@@ -0,0 +1,17 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H 1
+
+#include <stdint.h>
+#include "exe2icns.h"
+#include "image.h"
+
+// halve image with a gamma-correct (2.2) 2 x 2 box filter; the mask is averaged without gamma
+// width and height must be even, and out is allocated at (width / 2) x (height / 2)
+void HalveImage(const Image *image, Image *out);
+
+// scale image to the size out is allocated at with filter (kExe2ICNSFilterBox etc.), rows then columns
+// the colours are filtered in linear light, premultiplied by the mask, so transparent pixels don't bleed in
+// returns 0, or -1 if there's no memory for the work buffers (from allocator, or malloc if NULL)
+int ResampleImage(int filter, const Image *image, Image *out, const Exe2ICNSAllocator *allocator);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "taskpool.h"
+
+// indices [next, end) still to be run by a worker
+struct TaskRange_ {
+	pthread_mutex_t lock;
+	long next;
+	long end;
+};
+typedef struct TaskRange_ TaskRange;
+
+struct TaskPool_ {
+	TaskRange *ranges;
+	int nthreads;
+	TaskFunc func;
+	void *ctx;
+};
+typedef struct TaskPool_ TaskPool;
+
+struct Worker_ {
+	TaskPool *pool;
+	int index;
+};
+typedef struct Worker_ Worker;
+
+static int TakeOwn(TaskRange *range, long *outindex)
+{
+	int found = 0;
+	pthread_mutex_lock(&range->lock);
+	if (range->next < range->end) {
+		*outindex = range->next++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&range->lock);
+	return found;
+}
+
+// move the back half of somebody else's range into ours; returns 0 when everything is taken
+static int Steal(TaskPool *pool, int self, long *outindex)
+{
+	int i;
+	for (i = 1; i < pool->nthreads; i++) {
+		TaskRange *victim = &pool->ranges[(self + i) % pool->nthreads];
+		long first = 0, end = 0;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->next < victim->end) {
+			long n = (victim->end - victim->next + 1) / 2;
+			end = victim->end;
+			first = end - n;
+			victim->end = first;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (first < end) {
+			TaskRange *mine = &pool->ranges[self];
+			pthread_mutex_lock(&mine->lock);
+			mine->next = first + 1;
+			mine->end = end;
+			pthread_mutex_unlock(&mine->lock);
+			*outindex = first;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void * WorkerMain(void *arg)
+{
+	Worker *w = arg;
+	TaskPool *pool = w->pool;
+	long index;
+	while (TakeOwn(&pool->ranges[w->index], &index) || Steal(pool, w->index, &index))
+		pool->func(pool->ctx, index, w->index);
+	return NULL;
+}
+
+void RunTasks(long count, int nthreads, TaskFunc func, void *ctx)
+{
+	TaskPool pool;
+	Worker *workers;
+	pthread_t *threads;
+	int i;
+	
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads <= 1) {
+		long l;
+		for (l = 0; l < count; l++)
+			func(ctx, l, 0);
+		return;
+	}
+	
+	pool.ranges = malloc(nthreads * sizeof(TaskRange));
+	workers = malloc(nthreads * sizeof(Worker));
+	threads = malloc(nthreads * sizeof(pthread_t));
+	if (pool.ranges == NULL || workers == NULL || threads == NULL) {
+		long l;
+		free(pool.ranges);
+		free(workers);
+		free(threads);
+		for (l = 0; l < count; l++)
+			func(ctx, l, 0);
+		return;
+	}
+	pool.nthreads = nthreads;
+	pool.func = func;
+	pool.ctx = ctx;
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&pool.ranges[i].lock, NULL);
+		pool.ranges[i].next = count * i / nthreads;
+		pool.ranges[i].end = count * (i + 1) / nthreads;
+		workers[i].pool = &pool;
+		workers[i].index = i;
+	}
+	
+	// worker 0 is this thread; if a thread can't be started its share gets stolen by the others
+	threads[0] = pthread_self();
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, WorkerMain, &workers[i]) != 0)
+			threads[i] = threads[0];
+	}
+	WorkerMain(&workers[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (! pthread_equal(threads[i], threads[0]))
+			pthread_join(threads[i], NULL);
+	}
+	
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_destroy(&pool.ranges[i].lock);
+	free(pool.ranges);
+	free(workers);
+	free(threads);
+}
+
+int CountProcessors(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
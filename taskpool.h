@@ -0,0 +1,16 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H 1
+
+// called once for every index; worker is 0 ... nthreads - 1 and tells which thread runs it
+typedef void (*TaskFunc)(void *ctx, long index, int worker);
+
+// run func for index = 0 ... count - 1 on up to nthreads threads (the caller's thread is one of them)
+// each worker starts with a contiguous share of the indices, takes them from the front,
+// and steals the back half of another worker's share once its own runs out
+// returns when every index is done
+void RunTasks(long count, int nthreads, TaskFunc func, void *ctx);
+
+// number of online processors (at least 1)
+int CountProcessors(void);
+
+#endif